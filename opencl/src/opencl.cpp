@@ -6,22 +6,102 @@
 // include the Defold SDK
 #include <dmsdk/sdk.h>
 
-#if defined(DM_PLATFORM_OSX) || defined(DM_PLATFORM_WINDOWS)
-//TODO linux and other platforms
+#if defined(DM_PLATFORM_OSX) || defined(DM_PLATFORM_WINDOWS) || defined(DM_PLATFORM_LINUX)
+//TODO other platforms
+
+#ifndef CL_TARGET_OPENCL_VERSION
+#define CL_TARGET_OPENCL_VERSION 120
+#endif
 
 #include <CL/cl.h>
 #include <chrono>
+#include <thread>
+
+// host memory reused by all blocking uploads and readbacks of the device
+struct staging_data {
+    cl_mem mem;
+    void* ptr;
+    size_t size;
+};
+
+#define POOL_CLASSES 9 // power of two size classes starting from the device base address alignment
+#define POOL_ACCESS 3 // read-write, read-only and write-only blocks are kept apart
+#define POOL_MAX_SIZE (64 * 1024) // larger buffers are allocated directly
+#define POOL_SLAB_SIZE (1024 * 1024)
+
+#define HASH_CHUNK_SIZE (16 * 1024) // granularity of change tracking of uploaded streams
+
+struct device_data;
+struct device_pool;
+
+// sub-buffer of a slab, created once and reused by allocations of its size class and access
+struct pool_block {
+    cl_mem mem;
+    uint32_t size_class;
+    uint32_t access;
+    device_pool* pool;
+    pool_block* next; // in free list
+    cl_event fences[2]; // last commands of both queues when the block was freed, NULL if none
+};
+
+struct pool_slab {
+    cl_mem mem;
+    pool_block* blocks;
+    uint32_t count;
+};
+
+// free blocks in order of release, so the head is the one most likely idle on device
+struct pool_list {
+    pool_block* head;
+    pool_block* tail;
+};
+
+// small buffers carved from large slabs, allocation and free are O(1) and never wait for device
+struct device_pool {
+    device_data* device; // NULL once orphaned
+    size_t min_size; // of the first class, multiple of CL_DEVICE_MEM_BASE_ADDR_ALIGN
+    pool_slab* slabs;
+    uint32_t slabs_count;
+    pool_list free[POOL_ACCESS][POOL_CLASSES];
+    uint32_t in_use;
+    bool orphaned; // device is released, pool is freed once the last block is returned
+};
+
+// built program kept by the device for repeated loads of the same source
+struct program_cache_entry {
+    uint64_t key;
+    cl_program program;
+    uint32_t refs; // program userdata using the entry, the entry is dropped with the last one
+};
+
+// fastest work-group size found for a kernel and global size, local[0] == 0 means driver's choice
+struct tuning_entry {
+    uint64_t key;
+    uint32_t local[3];
+};
 
 struct device_data {
     cl_device_id id;
+    cl_platform_id platform;
+    cl_device_type type;
     cl_context context;
-    cl_command_queue queue;
+    cl_command_queue queue; // kernels and blocking transfers
+    cl_command_queue transfer; // non-blocking uploads and reads, overlap with kernels
+    bool profiling; // queue created with CL_QUEUE_PROFILING_ENABLE
+    bool out_of_order; // queue created with CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE
+    staging_data staging;
+    program_cache_entry* programs;
+    uint32_t programs_count;
+    tuning_entry* tuning;
+    uint32_t tuning_count;
+    bool tuning_loaded;
+    device_pool* pool; // created on first small allocation
 };
 
 struct program_data {
     cl_program program;
-    cl_command_queue* queue;
-    cl_context* context;
+    device_data* device;
+    uint64_t key; // hash of source and build options
 };
 
 enum BUFFER_TYPE {
@@ -33,61 +113,658 @@ enum BUFFER_TYPE {
     uint3
 };
 
+// device allocation of a ring buffer, reused every slots_count uploads
+struct ring_slot {
+    cl_mem mem;
+    void* host; // packed stream, source of the upload
+    cl_event upload; // last upload into the slot, kernels using the slot wait for it
+    cl_event fence; // last kernel reading the slot, next upload waits for it
+};
+
+// streaming input uploaded every frame into the next of several allocations, without reallocation
+struct ring_data {
+    device_data* device;
+    BUFFER_TYPE type;
+    size_t count;
+    ring_slot* slots;
+    uint32_t slots_count;
+    uint32_t current; // slot of the last upload, bound to kernels on run
+};
+
 struct buffer_data {
     cl_mem mem;
+    pool_block* block; // pooled allocation of mem, returned to the pool on release, NULL otherwise
+    BUFFER_TYPE type;
+    ring_data* ring; // kernel argument bound to the current slot of the ring on run, NULL otherwise
+    int buffer_ref; // dmBuffer used in place by mem (CL_MEM_USE_HOST_PTR) or ring buffer, LUA_NOREF otherwise
+    uint64_t* hashes; // per chunk content hashes of read-only argument, only changed chunks are uploaded again, NULL if not tracked
+    size_t size; // of tracked content
+    cl_event upload; // non-blocking upload into pooled mem, kernels wait for it on run, NULL if none or completed
+    void* host; // source of the upload, freed with the event once the upload is seen completed
+};
+
+enum PROFILE_TYPE {
+    PROFILE_RUN,
+    PROFILE_UPLOAD,
+    PROFILE_READ,
+    PROFILE_COUNT
+};
+
+// device timestamps (ns) of the last command of a kind
+struct profile_data {
+    cl_ulong queued;
+    cl_ulong submit;
+    cl_ulong start;
+    cl_ulong end;
+    bool valid;
+};
+
+// standalone device buffer, can be bound to arguments of any kernel of the same device
+struct mem_data {
+    cl_mem mem;
+    BUFFER_TYPE type;
+    size_t count;
+    device_data* device;
+    profile_data profile[PROFILE_COUNT];
+};
+
+struct dispatch_data {
+    cl_uint dim;
+    size_t global[3];
+    size_t local[3];
+    bool has_local;
+    size_t offset[3];
+    bool has_offset;
+    bool pad; // round global size up to a multiple of local size
+    int extent_arg; // kernel argument receiving the real global size, -1 if none
+};
+
+struct event_data {
+    cl_event event;
+};
+
+// non-blocking read in flight, data is unpacked once the read event completes
+struct read_data {
+    void* output;
+    size_t count;
     BUFFER_TYPE type;
+    dmBuffer::HBuffer buffer;
+    dmhash_t stream;
+    int buffer_ref; // keeps dmBuffer alive until the read completes, LUA_NOREF if result is passed to the callback as lua table
+};
+
+// program build in flight, its user event is completed by the build thread once the build is done
+struct build_data {
+    cl_program program;
+    device_data* device;
+    uint64_t source_key;
+    uint64_t disk_key;
+    bool compiled; // built from source, not taken from a cache
+};
+
+struct pending_data {
+    cl_event event;
+    dmScript::LuaCallbackInfo* callback; // can be NULL for reads into dmBuffer
+    int ref; // event userdata passed to the callback
+    read_data* read;
+    build_data* build;
+    void* host; // source of non-blocking upload, freed once it completes
 };
 
 struct kernel_data {
     cl_kernel kernel;
     buffer_data* buffers;
     cl_uint args_count;
-    cl_command_queue* queue;
-    cl_context* context;
+    device_data* device;
+    profile_data profile[PROFILE_COUNT];
+    uint64_t key; // identifies kernel function of the program
 };
 
+// large range executed in tiles along the last dimension, as many tiles per frame as fit the budget
+struct slice_job_data {
+    kernel_data* kernel;
+    int kernel_ref; // keeps kernel alive while the job runs
+    dispatch_data dispatch; // whole range
+    size_t done; // items of the last dimension already executed
+    size_t granularity; // tile size along the last dimension is a multiple of it
+    double budget; // seconds per frame
+    double rate; // measured items of the last dimension per second, 0 until first tile
+    bool cancelled;
+    bool running; // registered in jobs and referenced
+    dmScript::LuaCallbackInfo* callback;
+    int ref; // job userdata
+};
 
-cl_platform_id platform_id;
+// same kernel on several devices, range is split along the last dimension weighted by measured throughput
+struct multi_kernel_data {
+    uint32_t count;
+    kernel_data** kernels;
+    int* refs; // kernel userdata
+    double* rates; // items of the last dimension per second, first estimate is from device info
+    bool measured; // rates are measured, not estimated
+    size_t* split; // count + 1 boundaries of the last run relative to its start
+    size_t base; // offset of the last run in the last dimension
+};
 
-static int Device_destroy(lua_State* L){
-    dmLogInfo("device destroy");
-    device_data* data = (device_data*)luaL_checkudata(L, 1, "device");
-    clReleaseCommandQueue(data->queue);
-    clReleaseContext(data->context);
-    return 0;
+enum COMMAND_TYPE {
+    COMMAND_ARG_INT,
+    COMMAND_ARG_FLOAT,
+    COMMAND_ARG_VEC3,
+    COMMAND_ARG_MEM,
+    COMMAND_RUN,
+    COMMAND_COPY,
+    COMMAND_READ
+};
+
+// recorded command, buffers are resolved on submit since uploads can replace their cl_mem
+struct command_data {
+    COMMAND_TYPE type;
+    kernel_data* kernel;
+    cl_uint index; // kernel argument
+    mem_data* src; // NULL for reads of kernel argument
+    mem_data* dst;
+    union {
+        cl_int i;
+        cl_float f;
+        cl_float3 v;
+    } value; // patchable scalar
+    dispatch_data dispatch;
+    size_t count;
+    dmBuffer::HBuffer buffer;
+    dmhash_t stream;
+    void* output; // read destination on host, reused by every submit
+    size_t size; // of output
+};
+
+struct command_list_data {
+    command_data* commands;
+    uint32_t count;
+    int* refs; // kernels, buffers and dmBuffers used by commands
+    uint32_t refs_count;
+};
+
+cl_platform_id* platforms = NULL;
+cl_uint num_platforms = 0;
+
+dmArray<pending_data> pending;
+
+dmArray<slice_job_data*> jobs;
+
+dmArray<device_data*> device_registry;
+
+bool profiling = false; // new queues are created with profiling enabled
+
+bool out_of_order = false; // new queues are created out of order, if device supports it
+
+char* cache_path = NULL; // directory of cached program binaries, cache is disabled if NULL
+
+static void ReleaseStaging(device_data* device)
+{
+    staging_data* st = &device->staging;
+
+    if (st->mem != NULL) {
+        clEnqueueUnmapMemObject(device->queue, st->mem, st->ptr, 0, NULL, NULL);
+        clFinish(device->queue);
+        clReleaseMemObject(st->mem);
+    }else {
+        free(st->ptr);
+    }
+
+    st->mem = NULL;
+    st->ptr = NULL;
+    st->size = 0;
+}
+
+// returns host memory of at least size bytes for packing uploads and receiving blocking reads.
+// memory is valid until the next call, it's pinned (CL_MEM_ALLOC_HOST_PTR) when the device supports it
+static void* AcquireStaging(device_data* device, size_t size)
+{
+    staging_data* st = &device->staging;
+
+    if (size <= st->size) {
+        return st->ptr;
+    }
+
+    size_t new_size = st->size > 0 ? st->size : 64 * 1024;
+    while (new_size < size) {
+        new_size *= 2;
+    }
+
+    ReleaseStaging(device);
+
+    cl_int err;
+    st->mem = clCreateBuffer(device->context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_WRITE, new_size, NULL, &err);
+
+    if (err == CL_SUCCESS) {
+        st->ptr = clEnqueueMapBuffer(device->queue, st->mem, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, new_size, 0, NULL, NULL, &err);
+    }
+
+    if (err != CL_SUCCESS) { // fallback to regular memory
+        dmLogInfo("pinned staging of %u bytes failed: %d", (uint32_t)new_size, err);
+        if (st->mem != NULL) {
+            clReleaseMemObject(st->mem);
+            st->mem = NULL;
+        }
+        st->ptr = malloc(new_size);
+    }
+
+    st->size = new_size;
+    return st->ptr;
+}
+
+static void ReleaseFences(pool_block* block)
+{
+    for (int i = 0; i < 2; ++i) {
+        if (block->fences[i] != NULL) {
+            clReleaseEvent(block->fences[i]);
+            block->fences[i] = NULL;
+        }
+    }
+}
+
+// device is done with the block once commands enqueued before its release have finished
+static bool IsBlockIdle(const pool_block* block)
+{
+    for (int i = 0; i < 2; ++i) {
+        if (block->fences[i] != NULL) {
+            cl_int status = CL_QUEUED;
+            clGetEventInfo(block->fences[i], CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+            if (status != CL_COMPLETE && status >= 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void FreePool(device_pool* pool)
+{
+    for (uint32_t i = 0; i < pool->slabs_count; ++i) {
+        for (uint32_t j = 0; j < pool->slabs[i].count; ++j) {
+            ReleaseFences(&pool->slabs[i].blocks[j]);
+            clReleaseMemObject(pool->slabs[i].blocks[j].mem);
+        }
+        free(pool->slabs[i].blocks);
+        clReleaseMemObject(pool->slabs[i].mem);
+    }
+    free(pool->slabs);
+    free(pool);
+}
+
+// carves new slab into blocks of the size class, new blocks are put in front of the free list as they are idle
+static bool GrowPool(device_data* device, device_pool* pool, uint32_t access, uint32_t size_class)
+{
+    static const cl_mem_flags flags[POOL_ACCESS] = {CL_MEM_READ_WRITE, CL_MEM_READ_ONLY, CL_MEM_WRITE_ONLY};
+    size_t size = pool->min_size << size_class;
+
+    cl_int err;
+    cl_mem mem = clCreateBuffer(device->context, CL_MEM_READ_WRITE, POOL_SLAB_SIZE, NULL, &err);
+    if (err != CL_SUCCESS) {
+        return false;
+    }
+
+    pool->slabs = (pool_slab*)realloc(pool->slabs, sizeof(pool_slab) * (pool->slabs_count + 1));
+    pool_slab* slab = &pool->slabs[pool->slabs_count++];
+    slab->mem = mem;
+    slab->count = 0;
+    slab->blocks = (pool_block*)malloc(sizeof(pool_block) * (POOL_SLAB_SIZE / size));
+
+    pool_list* list = &pool->free[access][size_class];
+
+    for (size_t offset = 0; offset + size <= POOL_SLAB_SIZE; offset += size) {
+        cl_buffer_region region = {offset, size};
+        cl_mem sub = clCreateSubBuffer(mem, flags[access], CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+        if (err != CL_SUCCESS) {
+            break;
+        }
+
+        pool_block* block = &slab->blocks[slab->count++];
+        block->mem = sub;
+        block->size_class = size_class;
+        block->access = access;
+        block->pool = pool;
+        block->fences[0] = NULL;
+        block->fences[1] = NULL;
+        block->next = list->head;
+        list->head = block;
+        if (list->tail == NULL) {
+            list->tail = block;
+        }
+    }
+
+    return slab->count > 0;
+}
+
+// returns NULL if size isn't pooled, buffer is allocated directly then
+static pool_block* PoolAlloc(device_data* device, size_t size, cl_mem_flags flags)
+{
+    if (size == 0 || size > POOL_MAX_SIZE) {
+        return NULL;
+    }
+
+    if (device->pool == NULL) {
+        cl_uint align = 0; // in bits
+        clGetDeviceInfo(device->id, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(align), &align, NULL);
+
+        device_pool* pool = (device_pool*)calloc(1, sizeof(device_pool));
+        pool->device = device;
+        pool->min_size = 256;
+        while (pool->min_size < align / 8) {
+            pool->min_size *= 2;
+        }
+        device->pool = pool;
+    }
+
+    device_pool* pool = device->pool;
+    uint32_t size_class = 0;
+    while (size_class < POOL_CLASSES && (pool->min_size << size_class) < size) {
+        ++size_class;
+    }
+
+    if (size_class == POOL_CLASSES || (pool->min_size << size_class) > POOL_SLAB_SIZE) {
+        return NULL;
+    }
+
+    uint32_t access = flags == CL_MEM_READ_ONLY ? 1 : flags == CL_MEM_WRITE_ONLY ? 2 : 0;
+    pool_list* list = &pool->free[access][size_class];
+
+    // block still in use by device isn't waited for, a new slab is carved instead
+    if ((list->head == NULL || !IsBlockIdle(list->head)) && !GrowPool(device, pool, access, size_class)) {
+        return NULL;
+    }
+
+    pool_block* block = list->head;
+    list->head = block->next;
+    if (list->head == NULL) {
+        list->tail = NULL;
+    }
+    ReleaseFences(block);
+
+    pool->in_use++;
+    return block;
+}
+
+// fences the block after all commands enqueued so far, it is handed out again once they finish
+static void PoolFree(pool_block* block)
+{
+    device_pool* pool = block->pool;
+    pool->in_use--;
+
+    if (!pool->orphaned) { // queues of orphaned pool are already finished and released
+        device_data* device = pool->device;
+        clEnqueueMarkerWithWaitList(device->queue, 0, NULL, &block->fences[0]);
+        clEnqueueMarkerWithWaitList(device->transfer, 0, NULL, &block->fences[1]);
+        clFlush(device->queue);
+        clFlush(device->transfer);
+    }
+
+    pool_list* list = &pool->free[block->access][block->size_class];
+    block->next = NULL;
+    if (list->tail != NULL) {
+        list->tail->next = block;
+    }else {
+        list->head = block;
+    }
+    list->tail = block;
+
+    if (pool->orphaned && pool->in_use == 0) {
+        FreePool(pool);
+    }
+}
+
+static void ReleasePool(device_pool* pool)
+{
+    pool->device = NULL;
+
+    if (pool->in_use > 0) { // kernels holding blocks can outlive the device
+        pool->orphaned = true;
+        return;
+    }
+
+    FreePool(pool);
+}
+
+// stores timestamps of the finished command into profile and releases the event
+static void StoreProfile(cl_event event, profile_data* profile)
+{
+    profile->valid = 
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &profile->queued, NULL) == CL_SUCCESS &&
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &profile->submit, NULL) == CL_SUCCESS &&
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &profile->start, NULL) == CL_SUCCESS &&
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &profile->end, NULL) == CL_SUCCESS;
+
+    clReleaseEvent(event);
+}
+
+// pushes {queued, submit, start, end} table or nil if there is no profiling info
+static void PushProfile(lua_State* L, const profile_data* profile)
+{
+    if (!profile->valid) {
+        lua_pushnil(L);
+        return;
+    }
+
+    lua_newtable(L);
+    lua_pushnumber(L, profile->queued);
+    lua_setfield(L, -2, "queued");
+    lua_pushnumber(L, profile->submit);
+    lua_setfield(L, -2, "submit");
+    lua_pushnumber(L, profile->start);
+    lua_setfield(L, -2, "start");
+    lua_pushnumber(L, profile->end);
+    lua_setfield(L, -2, "end");
+}
+
+static void ClearProfile(profile_data* profile)
+{
+    for (int i = 0; i < PROFILE_COUNT; ++i) {
+        profile[i].valid = false;
+    }
+}
+
+// returns registry entry of the device, all scripts share it and its context
+static device_data* GetDeviceData(cl_platform_id platform, cl_device_id id, cl_device_type type)
+{
+    for (uint32_t i = 0; i < device_registry.Size(); ++i) {
+        if (device_registry[i]->id == id) {
+            return device_registry[i];
+        }
+    }
+
+    device_data* data = (device_data*)malloc(sizeof(device_data));
+    data->id = id;
+    data->platform = platform;
+    data->type = type;
+    data->context = NULL;
+    data->queue = NULL;
+    data->transfer = NULL;
+    data->profiling = false;
+    data->out_of_order = false;
+    data->staging.mem = NULL;
+    data->staging.ptr = NULL;
+    data->staging.size = 0;
+    data->programs = NULL;
+    data->programs_count = 0;
+    data->tuning = NULL;
+    data->tuning_count = 0;
+    data->tuning_loaded = false;
+    data->pool = NULL;
+
+    if (device_registry.Full()) {
+        device_registry.OffsetCapacity(4);
+    }
+    device_registry.Push(data);
+
+    return data;
+}
+
+// context and queue are created on first use of the device
+static void InitDeviceContext(device_data* device)
+{
+    if (device->context != NULL) {
+        return;
+    }
+
+    cl_context_properties properties[] = {CL_CONTEXT_PLATFORM, (cl_context_properties)device->platform, 0};
+    device->context = clCreateContext(properties, 1, &device->id, NULL, NULL, NULL);
+    device->profiling = profiling;
+
+    cl_command_queue_properties supported = 0;
+    clGetDeviceInfo(device->id, CL_DEVICE_QUEUE_PROPERTIES, sizeof(supported), &supported, NULL);
+    device->out_of_order = out_of_order && (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+
+    cl_command_queue_properties props = 0;
+    props |= profiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+    props |= device->out_of_order ? CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE : 0;
+    device->queue = clCreateCommandQueue(device->context, device->id, props, NULL);
+    device->transfer = clCreateCommandQueue(device->context, device->id, props, NULL);
+}
+
+// blocking commands have to see results of everything enqueued before them, in both queues
+static void OrderQueue(device_data* device)
+{
+    cl_event markers[2];
+    clEnqueueMarkerWithWaitList(device->transfer, 0, NULL, &markers[0]);
+    clEnqueueMarkerWithWaitList(device->queue, 0, NULL, &markers[1]);
+    clFlush(device->transfer);
+    clEnqueueBarrierWithWaitList(device->queue, 2, markers, NULL);
+    clReleaseEvent(markers[0]);
+    clReleaseEvent(markers[1]);
+}
+
+static void ReleaseDeviceData(device_data* device)
+{
+    for (uint32_t i = 0; i < device->programs_count; ++i) {
+        clReleaseProgram(device->programs[i].program);
+    }
+    free(device->programs);
+    free(device->tuning);
+
+    if (device->pool != NULL) {
+        ReleasePool(device->pool);
+    }
+
+    if (device->context != NULL) {
+        ReleaseStaging(device);
+        clFinish(device->transfer);
+        clReleaseCommandQueue(device->transfer);
+        clReleaseCommandQueue(device->queue);
+        clReleaseContext(device->context);
+    }
+
+    free(device);
+}
+
+// drops cache entry of the program once no program userdata uses it
+static void ReleaseCachedProgram(device_data* device, uint64_t key)
+{
+    bool alive = false; // programs can outlive the device
+    for (uint32_t i = 0; i < device_registry.Size(); ++i) {
+        alive = alive || device_registry[i] == device;
+    }
+    if (!alive) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < device->programs_count; ++i) {
+        program_cache_entry* entry = &device->programs[i];
+        if (entry->key == key) {
+            if (entry->refs > 0 && --entry->refs == 0) {
+                clReleaseProgram(entry->program);
+                *entry = device->programs[--device->programs_count];
+            }
+            return;
+        }
+    }
 }
 
 static int Program_destroy(lua_State* L){
     dmLogInfo("program destroy");
     program_data* data = (program_data*)luaL_checkudata(L, 1, "program");
+    ReleaseCachedProgram(data->device, data->key);
     clReleaseProgram(data->program);
     return 0;
 }
 
+// releases event and source of the pooled upload, if wait is false only once it completed
+static void ReleaseUpload(buffer_data* bd, bool wait)
+{
+    if (bd->upload == NULL) {
+        return;
+    }
+
+    if (wait) {
+        clWaitForEvents(1, &bd->upload); // device mustn't read from released host memory
+    }else {
+        cl_int status = CL_QUEUED;
+        clGetEventInfo(bd->upload, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+        if (status != CL_COMPLETE && status >= 0) {
+            return;
+        }
+    }
+
+    clReleaseEvent(bd->upload);
+    bd->upload = NULL;
+    free(bd->host);
+    bd->host = NULL;
+}
+
+static void ReleaseBufferData(lua_State* L, buffer_data* bd)
+{
+    ReleaseUpload(bd, true);
+
+    if (bd->block != NULL) {
+        PoolFree(bd->block);
+        bd->block = NULL;
+    }else if (bd->mem != NULL) {
+        clReleaseMemObject(bd->mem);
+    }
+
+    bd->mem = NULL;
+    bd->ring = NULL;
+
+    free(bd->hashes);
+    bd->hashes = NULL;
+
+    if (bd->buffer_ref != LUA_NOREF) {
+        dmScript::Unref(L, LUA_REGISTRYINDEX, bd->buffer_ref);
+        bd->buffer_ref = LUA_NOREF;
+    }
+}
+
 static int Kernel_destroy(lua_State* L){
     dmLogInfo("kernel destroy");
     kernel_data* data = (kernel_data*)luaL_checkudata(L, 1, "kernel");
     for (int i = 0; i < data->args_count; i++) {
-        if (data->buffers[i].mem != NULL) {
-            clReleaseMemObject(data->buffers[i].mem);
-        }
+        ReleaseBufferData(L, &data->buffers[i]);
     }
     free(data->buffers);
     clReleaseKernel(data->kernel);
     return 0;
 }
 
-void AllocBufferData(kernel_data* kd, int idx)
+static int Mem_destroy(lua_State* L){
+    dmLogInfo("buffer destroy");
+    mem_data* data = (mem_data*)luaL_checkudata(L, 1, "clbuffer");
+    clReleaseMemObject(data->mem);
+    return 0;
+}
+
+void AllocBufferData(lua_State* L, kernel_data* kd, int idx)
 {
-    if (kd->buffers == NULL) {
-        kd->buffers = (buffer_data*)malloc(sizeof(buffer_data) * (idx + 1));
-    }else if (kd->args_count <= idx) {
+    if (kd->args_count <= idx) {
         kd->buffers = (buffer_data*)realloc(kd->buffers, sizeof(buffer_data) * (idx + 1));
         for (int i = kd->args_count; i < idx + 1; i ++) {
             kd->buffers[i].mem = NULL;
+            kd->buffers[i].block = NULL;
+            kd->buffers[i].ring = NULL;
+            kd->buffers[i].buffer_ref = LUA_NOREF;
+            kd->buffers[i].hashes = NULL;
+            kd->buffers[i].upload = NULL;
+            kd->buffers[i].host = NULL;
         }
-    }else if (kd->buffers[idx].mem != NULL) {
-        clReleaseMemObject(kd->buffers[idx].mem);
+    }else {
+        ReleaseBufferData(L, &kd->buffers[idx]);
     }
 
     kd->args_count = idx + 1 > kd->args_count ? idx + 1 : kd->args_count;
@@ -99,7 +776,7 @@ static int SetKernelArgNull(lua_State* L)
     int idx = luaL_checkint(L, 2) - 1; 
     size_t size = luaL_checknumber(L, 3); 
     clSetKernelArg(kd->kernel, idx, size, NULL);
-    AllocBufferData(kd, idx);
+    AllocBufferData(L, kd, idx);
     kd->buffers[idx].mem = NULL;
     return 0;
 }
@@ -110,7 +787,7 @@ static int SetKernelArgInt(lua_State* L)
     int idx = luaL_checkint(L, 2) - 1; 
     int value = luaL_checkint(L, 3); 
     clSetKernelArg(kd->kernel, idx, sizeof(int), &value);
-    AllocBufferData(kd, idx);
+    AllocBufferData(L, kd, idx);
     kd->buffers[idx].mem = NULL;
     return 0;
 }
@@ -121,7 +798,7 @@ static int SetKernelArgFloat(lua_State* L)
     int idx = luaL_checkint(L, 2) - 1; 
     float value = luaL_checknumber(L, 3); 
     clSetKernelArg(kd->kernel, idx, sizeof(float), &value);
-    AllocBufferData(kd, idx);
+    AllocBufferData(L, kd, idx);
     kd->buffers[idx].mem = NULL;
     return 0;
 }
@@ -147,54 +824,326 @@ static int SetKernelArgVec3(lua_State* L)
     
     
     clSetKernelArg(kd->kernel, idx, sizeof(cl_float3), &value);
-    AllocBufferData(kd, idx);
+    AllocBufferData(L, kd, idx);
     kd->buffers[idx].mem = NULL;
     return 0;
 }
 
-template <typename T, typename CLT>
-void CreateBufferV3(int idx, uint32_t count, uint32_t stride, void* values, kernel_data* kd, cl_mem_flags flags, BUFFER_TYPE type)
+struct stream_data {
+    void* values;
+    uint32_t count;
+    uint32_t components;
+    uint32_t stride;
+    BUFFER_TYPE type;
+};
+
+static size_t GetElementSize(BUFFER_TYPE type)
 {
-    T *data =  (T*)values;
-    CLT array[count];
-    for (uint i = 0; i < count; ++i) {
-        array[i].x = data[0];
-        array[i].y = data[1];
-        array[i].z = data[2];
-        data += stride;
+    switch(type) {
+        case float3: return sizeof(cl_float3);
+        case uchar3: return sizeof(cl_uchar3);
+        case uint3: return sizeof(cl_uint3);
+        case uchar1: return sizeof(cl_uchar);
+        case uint1: return sizeof(cl_uint);
+        default: return sizeof(cl_float);
     }
+}
 
-    cl_mem buf = clCreateBuffer(*kd->context, flags, sizeof(CLT) * count, array, NULL);
-    clSetKernelArg(kd->kernel, idx, sizeof(cl_mem), &buf);
-
-    kd->buffers[idx].mem = buf;
-    kd->buffers[idx].type = type;
+static bool IsVectorType(BUFFER_TYPE type)
+{
+    return type == float3 || type == uchar3 || type == uint3;
 }
 
-template <typename T>
-void CreateBuffer(int idx, uint32_t count, uint32_t stride, uint32_t components, void* values, kernel_data* kd, cl_mem_flags flags, BUFFER_TYPE type)
+// size of a single value in dmBuffer stream
+static size_t GetComponentSize(BUFFER_TYPE type)
 {
-    T array[count * components];
-    T *data = (T*)values;
-    for (uint i = 0; i < count; ++i) {
-        for (int c = 0; c < components; ++c)
-        {
-            array[i * components + c] = data[c];
-        }
+    return type == uchar1 || type == uchar3 ? sizeof(uint8_t) : sizeof(uint32_t);
+}
 
-        data += stride;
+static cl_mem_flags GetAccessFlags(bool read, bool write)
+{
+    if (read && !write) {
+        return CL_MEM_READ_ONLY;
+    }else if (!read && write) {
+        return CL_MEM_WRITE_ONLY;
     }
+    return CL_MEM_READ_WRITE;
+}
 
-    cl_mem buf = clCreateBuffer(*kd->context, flags, sizeof(T) * count * components, array, NULL);
-    clSetKernelArg(kd->kernel, idx, sizeof(cl_mem), &buf);
+static bool GetStreamData(dmBuffer::HBuffer buffer, dmhash_t streamName, stream_data* stream)
+{
+    //TODO: different value types
+    dmBuffer::Result dataResult = dmBuffer::GetStream(buffer, streamName, &stream->values, &stream->count, &stream->components, &stream->stride);
+    if (dataResult != dmBuffer::RESULT_OK) {
+        return false;
+    }
+
+    dmBuffer::ValueType valuetype;
+    dmBuffer::GetStreamType(buffer, streamName, &valuetype, &stream->components);
+    const char* stype = dmBuffer::GetValueTypeString(valuetype);
+
+    //dmLogInfo("buffer %d, %d, %d", count,components, stride );
+
+    if ((stream->components == 3) && (strcmp(stype,"VALUE_TYPE_UINT8") == 0)) { //array of uchar3!
+        stream->type = uchar3;
+    } else if ((stream->components == 3) && (strcmp(stype,"VALUE_TYPE_UINT32") == 0)) {
+        stream->type = uint3;
+    } else if (stream->components == 3) { //array of float3!
+        stream->type = float3;
+    } else if (strcmp(stype,"VALUE_TYPE_UINT8") == 0) {
+        stream->type = uchar1;
+    } else if (strcmp(stype,"VALUE_TYPE_UINT32") == 0) {
+        stream->type = uint1;
+    } else {
+        stream->type = float1;
+    }
+
+    return true;
+}
+
+// number of buffer elements the stream occupies once packed
+static size_t GetStreamElements(const stream_data* stream)
+{
+    return IsVectorType(stream->type) ? stream->count : stream->count * stream->components;
+}
+
+template <typename T, typename CLT>
+void PackVectors(CLT* array, uint32_t count, uint32_t stride, void* values)
+{
+    T *data =  (T*)values;
+    for (uint i = 0; i < count; ++i) {
+        array[i].x = data[0];
+        array[i].y = data[1];
+        array[i].z = data[2];
+        data += stride;
+    }
+}
+
+template <typename T>
+void Pack(T* array, uint32_t count, uint32_t stride, uint32_t components, void* values)
+{
+    T *data = (T*)values;
+    for (uint i = 0; i < count; ++i) {
+        for (int c = 0; c < components; ++c)
+        {
+            array[i * components + c] = data[c];
+        }
+
+        data += stride;
+    }
+}
+
+// stream items are laid out exactly as kernel expects them, no repacking needed
+static bool IsPackedStream(const stream_data* stream)
+{
+    return !IsVectorType(stream->type) && stream->stride == stream->components;
+}
+
+// copies stream values into data in device layout
+static void PackStream(const stream_data* stream, void* data)
+{
+    switch(stream->type) {
+        case uchar3:
+            PackVectors<unsigned char, cl_uchar3>((cl_uchar3*)data, stream->count, stream->stride, stream->values);
+            break;
+        case uint3:
+            PackVectors<uint32_t, cl_uint3>((cl_uint3*)data, stream->count, stream->stride, stream->values);
+            break;
+        case float3:
+            PackVectors<float, cl_float3>((cl_float3*)data, stream->count, stream->stride, stream->values);
+            break;
+        case uchar1:
+            Pack<cl_uchar>((cl_uchar*)data, stream->count, stream->stride, stream->components, stream->values);
+            break;
+        case uint1:
+            Pack<cl_uint>((cl_uint*)data, stream->count, stream->stride, stream->components, stream->values);
+            break;
+        case float1:
+            Pack<float>((float*)data, stream->count, stream->stride, stream->components, stream->values);
+            break;
+    }
+}
+
+// creates a new buffer from the stream if *buf is NULL, otherwise writes the stream into *buf at offset (bytes).
+// returns true if the new buffer uses stream memory in place, so dmBuffer has to outlive it
+static bool UploadStream(device_data* device, cl_mem* buf, const stream_data* stream, cl_mem_flags flags, size_t offset, profile_data* profile)
+{
+    size_t size = GetElementSize(stream->type) * GetStreamElements(stream);
+    void* data = stream->values;
+
+    if (IsPackedStream(stream)) {
+        if (*buf == NULL && (device->type & CL_DEVICE_TYPE_CPU)) { // device can access dmBuffer memory directly
+            *buf = clCreateBuffer(device->context, flags | CL_MEM_USE_HOST_PTR, size, data, NULL);
+            return true;
+        }
+    }else {
+        data = AcquireStaging(device, size);
+        PackStream(stream, data);
+    }
+
+    if (*buf == NULL && !device->profiling) {
+        *buf = clCreateBuffer(device->context, flags | CL_MEM_COPY_HOST_PTR, size, data, NULL);
+        return false;
+    }
 
-    kd->buffers[idx].mem = buf;
-    kd->buffers[idx].type = type;
+    if (*buf == NULL) { // explicit write to get the upload timestamps
+        *buf = clCreateBuffer(device->context, flags, size, NULL, NULL);
+    }
+
+    OrderQueue(device);
+
+    cl_event event = NULL;
+    clEnqueueWriteBuffer(device->queue, *buf, CL_TRUE, offset, size, data, 0, NULL, device->profiling ? &event : NULL);
+
+    if (event != NULL) {
+        StoreProfile(event, profile);
+    }
+
+    return false;
+}
+
+// non-cryptographic hash in 8 independent 32-bit lanes, written so compilers vectorize the main loop
+static uint64_t HashChunk(const uint8_t* data, size_t size)
+{
+    const uint32_t prime = 0x9E3779B1;
+    uint32_t lanes[8];
+    for (int l = 0; l < 8; ++l) {
+        lanes[l] = prime + l;
+    }
+
+    size_t blocks = size / sizeof(lanes);
+    for (size_t i = 0; i < blocks; ++i) {
+        uint32_t values[8];
+        memcpy(values, data + i * sizeof(lanes), sizeof(values));
+        for (int l = 0; l < 8; ++l) {
+            uint32_t h = (lanes[l] ^ values[l]) * prime;
+            lanes[l] = h ^ (h >> 15);
+        }
+    }
+
+    uint32_t tail[8] = {0};
+    memcpy(tail, data + blocks * sizeof(lanes), size - blocks * sizeof(lanes));
+    for (int l = 0; l < 8; ++l) {
+        uint32_t h = (lanes[l] ^ tail[l]) * prime;
+        lanes[l] = h ^ (h >> 15);
+    }
+
+    uint64_t hash = size;
+    for (int l = 0; l < 8; ++l) {
+        hash = (hash ^ lanes[l]) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+// uploads the stream into pooled mem without waiting, kernels wait for the upload on run.
+// the block is idle on device, so no other command has to be ordered against the upload
+static bool UploadPooled(device_data* device, buffer_data* bd, const stream_data* stream, profile_data* profile)
+{
+    size_t size = GetElementSize(stream->type) * GetStreamElements(stream);
+    bd->host = malloc(size);
+    PackStream(stream, bd->host);
+
+    cl_int status = clEnqueueWriteBuffer(device->transfer, bd->mem, CL_FALSE, 0, size, bd->host, 0, NULL, &bd->upload);
+    if (status != CL_SUCCESS) {
+        bd->upload = NULL;
+        free(bd->host);
+        bd->host = NULL;
+        return false;
+    }
+
+    clFlush(device->transfer);
+
+    if (device->profiling) { // timestamps are known once the upload finishes
+        clWaitForEvents(1, &bd->upload);
+        clRetainEvent(bd->upload);
+        StoreProfile(bd->upload, profile);
+    }
+
+    return true;
+}
+
+// stores hashes of all chunks of the packed content
+static void HashChunks(buffer_data* bd, const uint8_t* data)
+{
+    for (size_t offset = 0; offset < bd->size; offset += HASH_CHUNK_SIZE) {
+        size_t size = bd->size - offset < HASH_CHUNK_SIZE ? bd->size - offset : HASH_CHUNK_SIZE;
+        bd->hashes[offset / HASH_CHUNK_SIZE] = HashChunk(data + offset, size);
+    }
+}
+
+// uploads chunks of the stream which hashes differ from the ones of the previous upload, or all chunks.
+// device isn't touched if nothing changed
+static void UploadChangedChunks(device_data* device, buffer_data* bd, const stream_data* stream, bool all, profile_data* profile)
+{
+    const uint8_t* data = (const uint8_t*)stream->values;
+    if (!IsPackedStream(stream)) {
+        void* staging = AcquireStaging(device, bd->size);
+        PackStream(stream, staging);
+        data = (const uint8_t*)staging;
+    }
+
+    size_t chunks = (bd->size + HASH_CHUNK_SIZE - 1) / HASH_CHUNK_SIZE;
+    size_t* runs = NULL; // start and end offsets of runs of changed chunks
+    size_t runs_count = 0;
+    size_t start = 0;
+    bool dirty = false;
+
+    for (size_t offset = 0; offset < bd->size; offset += HASH_CHUNK_SIZE) {
+        size_t size = bd->size - offset < HASH_CHUNK_SIZE ? bd->size - offset : HASH_CHUNK_SIZE;
+        uint64_t hash = HashChunk(data + offset, size);
+        size_t chunk = offset / HASH_CHUNK_SIZE;
+        bool changed = all || bd->hashes[chunk] != hash;
+        bd->hashes[chunk] = hash;
+
+        if (changed && !dirty) {
+            start = offset;
+            dirty = true;
+        }else if (!changed && dirty) {
+            if (runs == NULL) {
+                runs = (size_t*)malloc(sizeof(size_t) * (chunks + 1));
+            }
+            runs[runs_count * 2] = start;
+            runs[runs_count * 2 + 1] = offset;
+            runs_count++;
+            dirty = false;
+        }
+    }
+
+    if (dirty) {
+        if (runs == NULL) {
+            runs = (size_t*)malloc(sizeof(size_t) * (chunks + 1));
+        }
+        runs[runs_count * 2] = start;
+        runs[runs_count * 2 + 1] = bd->size;
+        runs_count++;
+    }
+
+    if (runs_count == 0) {
+        return;
+    }
+
+    OrderQueue(device);
+
+    cl_event event = NULL;
+    for (size_t i = 0; i < runs_count; ++i) {
+        if (event != NULL) {
+            clReleaseEvent(event);
+        }
+        size_t offset = runs[i * 2];
+        clEnqueueWriteBuffer(device->queue, bd->mem, CL_FALSE, offset, runs[i * 2 + 1] - offset, data + offset, 0, NULL, device->profiling ? &event : NULL);
+    }
+    free(runs);
+
+    clFinish(device->queue); // stream and staging can change after return
+
+    if (event != NULL) {
+        StoreProfile(event, profile);
+    }
 }
 
 static int SetKernelArgBuffer(lua_State* L)
 {
-    //TODO: different value types, check strem dmBuffer::GetStreamType/dmBuffer::GetValueTypeString
     DM_LUA_STACK_CHECK(L, 0);
 
     kernel_data* kd = (kernel_data*)luaL_checkudata(L, 1, "kernel"); 
@@ -205,53 +1154,122 @@ static int SetKernelArgBuffer(lua_State* L)
     bool read = lua_toboolean(L, 5);
     bool write = lua_toboolean(L, 6);
 
-    cl_mem_flags flags = CL_MEM_COPY_HOST_PTR;
+    stream_data stream;
+    if (!GetStreamData(input, streamName, &stream)) {
+        return DM_LUA_ERROR("can't get stream");
+    }
 
-    if (read && !write) {
-        flags |= CL_MEM_READ_ONLY;
-    }else if (!read && write) {
-        flags |= CL_MEM_WRITE_ONLY;
-    }else {
-        flags |= CL_MEM_READ_WRITE;
+    size_t size = GetElementSize(stream.type) * GetStreamElements(&stream);
+    bool in_place = IsPackedStream(&stream) && (kd->device->type & CL_DEVICE_TYPE_CPU);
+
+    // kernel doesn't change read-only argument, so device content is still the one hashed at the last upload
+    bool track = read && !write && !in_place && size > 0;
+    if (track && idx >= 0 && (cl_uint)idx < kd->args_count) {
+        buffer_data* bd = &kd->buffers[idx];
+        if (bd->hashes != NULL && bd->type == stream.type && bd->size == size) {
+            UploadChangedChunks(kd->device, bd, &stream, false, &kd->profile[PROFILE_UPLOAD]);
+            return 0;
+        }
     }
 
-    void* values = 0x0;
-    uint32_t count = 0;
-    uint32_t components = 0;
-    uint32_t stride = 0;
-    dmBuffer::Result dataResult = dmBuffer::GetStream(input, streamName, (void**)&values, &count, &components, &stride);
-    if (dataResult != dmBuffer::RESULT_OK) {
-        return DM_LUA_ERROR("can't get stream");
+    AllocBufferData(L, kd, idx);
+
+    buffer_data* bd = &kd->buffers[idx];
+
+    // small buffers come from the pool, unless the device can use the stream in place
+    if (!in_place) {
+        bd->block = PoolAlloc(kd->device, size, GetAccessFlags(read, write));
     }
 
-    dmBuffer::ValueType valuetype;
-    
-    dmBuffer::GetStreamType(input, streamName, &valuetype, &components);
-    const char* stype = dmBuffer::GetValueTypeString(valuetype);
-    
-    //dmLogInfo("buffer %d, %d, %d", count,components, stride );
+    if (bd->block != NULL) {
+        bd->mem = bd->block->mem;
+        bd->type = stream.type;
+        if (!UploadPooled(kd->device, bd, &stream, &kd->profile[PROFILE_UPLOAD])) {
+            return DM_LUA_ERROR("Write error.");
+        }
 
-    AllocBufferData(kd, idx);
+        if (track) {
+            bd->size = size;
+            bd->hashes = (uint64_t*)malloc(sizeof(uint64_t) * ((size + HASH_CHUNK_SIZE - 1) / HASH_CHUNK_SIZE));
+            HashChunks(bd, (const uint8_t*)bd->host);
+        }
 
-    if ((components == 3) && (strcmp(stype,"VALUE_TYPE_UINT8") == 0)) { //create array of uchar3!
-        CreateBufferV3<unsigned char, cl_uchar3>(idx, count, stride, values, kd, flags, uchar3);
-        
-    } else if ((components == 3) && (strcmp(stype,"VALUE_TYPE_UINT32") == 0)) { 
-        CreateBufferV3<uint32_t, cl_uint3>(idx, count, stride, values, kd, flags, uint3);
+        clSetKernelArg(kd->kernel, idx, sizeof(cl_mem), &bd->mem);
+        return 0;
+    }
 
-    } else if (components == 3) { //create array of float3!
-        CreateBufferV3<float, cl_float3>(idx, count, stride, values, kd, flags, float3);
-        
-    } else if (strcmp(stype,"VALUE_TYPE_UINT8") == 0) {
-        CreateBuffer<cl_uchar>(idx, count, stride, components, values, kd, flags, uchar1);
-        
-    } else if (strcmp(stype,"VALUE_TYPE_UINT32") == 0) {
-        CreateBuffer<cl_uint>(idx, count, stride, components, values, kd, flags, uint1);
+    cl_mem buf = NULL;
 
-    } else {
-        CreateBuffer<float>(idx, count, stride, components, values, kd, flags, float1);
+    if (track) {
+        buf = clCreateBuffer(kd->device->context, GetAccessFlags(read, write), size, NULL, NULL);
+
+        bd->mem = buf;
+        bd->type = stream.type;
+        bd->size = size;
+        bd->hashes = (uint64_t*)malloc(sizeof(uint64_t) * ((size + HASH_CHUNK_SIZE - 1) / HASH_CHUNK_SIZE));
+        UploadChangedChunks(kd->device, bd, &stream, true, &kd->profile[PROFILE_UPLOAD]);
+
+        clSetKernelArg(kd->kernel, idx, sizeof(cl_mem), &buf);
+        return 0;
+    }
+
+    if (UploadStream(kd->device, &buf, &stream, GetAccessFlags(read, write), 0, &kd->profile[PROFILE_UPLOAD])) {
+        lua_pushvalue(L, 3);
+        bd->buffer_ref = dmScript::Ref(L, LUA_REGISTRYINDEX);
+    }
+    clSetKernelArg(kd->kernel, idx, sizeof(cl_mem), &buf);
+
+    bd->mem = buf;
+    bd->type = stream.type;
+
+    return 0;
+}
+
+static int SetKernelArgMem(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    kernel_data* kd = (kernel_data*)luaL_checkudata(L, 1, "kernel"); 
+    int idx = luaL_checkint(L, 2) - 1; 
+    mem_data* md = (mem_data*)luaL_checkudata(L, 3, "clbuffer");
+
+    if (md->device != kd->device) {
+        return DM_LUA_ERROR("buffer belongs to another device");
     }
-    
+
+    AllocBufferData(L, kd, idx);
+
+    clRetainMemObject(md->mem); // released with the kernel argument
+    clSetKernelArg(kd->kernel, idx, sizeof(cl_mem), &md->mem);
+
+    kd->buffers[idx].mem = md->mem;
+    kd->buffers[idx].type = md->type;
+
+    return 0;
+}
+
+// binds ring buffer to kernel argument, every run uses the slot of the last upload
+static int SetKernelArgRing(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    kernel_data* kd = (kernel_data*)luaL_checkudata(L, 1, "kernel");
+    int idx = luaL_checkint(L, 2) - 1;
+    ring_data* ring = (ring_data*)luaL_checkudata(L, 3, "ringbuffer");
+
+    if (ring->device != kd->device) {
+        return DM_LUA_ERROR("buffer belongs to another device");
+    }
+
+    AllocBufferData(L, kd, idx);
+
+    clSetKernelArg(kd->kernel, idx, sizeof(cl_mem), &ring->slots[ring->current].mem);
+
+    kd->buffers[idx].ring = ring;
+    kd->buffers[idx].type = ring->type;
+
+    lua_pushvalue(L, 3);
+    kd->buffers[idx].buffer_ref = dmScript::Ref(L, LUA_REGISTRYINDEX);
 
     return 0;
 }
@@ -266,399 +1284,2957 @@ void LoadWorkSize(lua_State* L, size_t* array, int index, cl_uint dim)
     }
 }
 
-static int RunKernel(lua_State* L)
+// reads dimensions, global and optional local work sizes starting from argument at index
+static void CheckDispatch(lua_State* L, int index, dispatch_data* dd)
 {
-    using namespace std::chrono;
-    
-    DM_LUA_STACK_CHECK(L, 1);
+    dd->dim = luaL_checkint(L, index);
+    if (dd->dim < 1 || dd->dim > 3) {
+        luaL_error(L, "dimensions must be 1, 2 or 3");
+    }
+
+    luaL_checktype(L, index + 1, LUA_TTABLE);
+    LoadWorkSize(L, dd->global, index + 1, dd->dim);
+
+    dd->has_local = lua_istable(L, index + 2);
+    if (dd->has_local) {
+        LoadWorkSize(L, dd->local, index + 2, dd->dim);
+    }
+
+    dd->pad = false;
+    dd->extent_arg = -1;
+    dd->has_offset = false;
+
+    if (lua_istable(L, index + 3)) { // options
+        lua_getfield(L, index + 3, "offset");
+        dd->has_offset = lua_istable(L, -1);
+        if (dd->has_offset) {
+            LoadWorkSize(L, dd->offset, lua_gettop(L), dd->dim);
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, index + 3, "pad");
+        dd->pad = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, index + 3, "extent_arg");
+        if (lua_isnumber(L, -1)) {
+            dd->extent_arg = lua_tonumber(L, -1) - 1;
+        }
+        lua_pop(L, 1);
+    }
+}
+
+// padded global size lets any local size be used, kernel skips work items beyond the extent
+static const size_t* PadGlobal(cl_uint dim, const size_t* global, const size_t* local, size_t* padded)
+{
+    if (local == NULL) {
+        return global;
+    }
+
+    for (cl_uint i = 0; i < dim; ++i) {
+        padded[i] = (global[i] + local[i] - 1) / local[i] * local[i];
+    }
+    return padded;
+}
+
+// passes end of the real range (offset + global size) to the kernel as int, int2 or int3
+static void SetExtentArg(kernel_data* kd, const dispatch_data* dd)
+{
+    size_t end[3];
+    for (cl_uint i = 0; i < dd->dim; ++i) {
+        end[i] = dd->global[i] + (dd->has_offset ? dd->offset[i] : 0);
+    }
+
+    if (dd->dim == 1) {
+        cl_int extent = end[0];
+        clSetKernelArg(kd->kernel, dd->extent_arg, sizeof(extent), &extent);
+    }else if (dd->dim == 2) {
+        cl_int2 extent;
+        extent.s[0] = end[0];
+        extent.s[1] = end[1];
+        clSetKernelArg(kd->kernel, dd->extent_arg, sizeof(extent), &extent);
+    }else {
+        cl_int3 extent;
+        extent.s[0] = end[0];
+        extent.s[1] = end[1];
+        extent.s[2] = end[2];
+        extent.s[3] = 0;
+        clSetKernelArg(kd->kernel, dd->extent_arg, sizeof(extent), &extent);
+    }
+}
+
+static bool IsDivisible(cl_uint dim, const size_t* global, const size_t* local)
+{
+    for (cl_uint i = 0; i < dim; ++i) {
+        if (global[i] % local[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static char* GetDeviceInfoString(cl_device_id id, cl_device_info param)
+{
+    size_t size;
+    clGetDeviceInfo(id, param, 0, NULL, &size);
+    char* info = (char *)malloc(size);
+    clGetDeviceInfo(id, param, size, info, NULL);
+    return info;
+}
+
+static void GetCacheFilePath(uint64_t key, const char* extension, char* path, size_t size)
+{
+    size_t len = strlen(cache_path);
+    bool separator = len > 0 && (cache_path[len - 1] == '/' || cache_path[len - 1] == '\\');
+    snprintf(path, size, "%s%s%016llx.%s", cache_path, separator ? "" : "/", (unsigned long long)key, extension);
+}
+
+// identifies device and driver version, compiled binaries and tuning results are specific to them
+static uint64_t GetDeviceKey(cl_device_id id)
+{
+    HashState64 state;
+    dmHashInit64(&state, false);
+
+    char* info = GetDeviceInfoString(id, CL_DEVICE_NAME);
+    dmHashUpdateBuffer64(&state, info, strlen(info));
+    free(info);
+
+    info = GetDeviceInfoString(id, CL_DRIVER_VERSION);
+    dmHashUpdateBuffer64(&state, info, strlen(info));
+    free(info);
+
+    return dmHashFinal64(&state);
+}
+
+static uint64_t GetTuningKey(kernel_data* kd, const dispatch_data* dd)
+{
+    HashState64 state;
+    dmHashInit64(&state, false);
+    dmHashUpdateBuffer64(&state, &kd->key, sizeof(kd->key));
+    for (cl_uint i = 0; i < dd->dim; ++i) {
+        uint64_t size = dd->global[i];
+        dmHashUpdateBuffer64(&state, &size, sizeof(size));
+    }
+    return dmHashFinal64(&state);
+}
+
+// reads tuning results of previous sessions if program cache is enabled
+static tuning_entry* FindTuning(device_data* device, uint64_t key)
+{
+    for (uint32_t i = 0; i < device->tuning_count; ++i) {
+        if (device->tuning[i].key == key) {
+            return &device->tuning[i];
+        }
+    }
+    return NULL;
+}
+
+// replaces entry of the same key, padding is cleared so stored entries are fully initialized
+static void AddTuningEntry(device_data* device, const tuning_entry* entry)
+{
+    tuning_entry* existing = FindTuning(device, entry->key);
+    if (existing == NULL) {
+        device->tuning = (tuning_entry*)realloc(device->tuning, sizeof(tuning_entry) * (device->tuning_count + 1));
+        existing = &device->tuning[device->tuning_count++];
+    }
+
+    memset(existing, 0, sizeof(tuning_entry));
+    existing->key = entry->key;
+    memcpy(existing->local, entry->local, sizeof(existing->local));
+}
+
+static void LoadTuning(device_data* device)
+{
+    if (device->tuning_loaded || cache_path == NULL) {
+        return;
+    }
+
+    device->tuning_loaded = true;
+
+    char path[1024];
+    GetCacheFilePath(GetDeviceKey(device->id), "tuning", path, sizeof(path));
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return;
+    }
+
+    tuning_entry entry;
+    while (fread(&entry, sizeof(entry), 1, file) == 1) {
+        AddTuningEntry(device, &entry); // files written by older versions have repeated keys
+    }
+
+    fclose(file);
+}
+
+// local is NULL if driver's choice of work-group size is the fastest
+static void AddTuning(device_data* device, uint64_t key, const size_t* local, cl_uint dim)
+{
+    LoadTuning(device); // file is rewritten below, so it has to be loaded first
+
+    tuning_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.key = key;
+    for (cl_uint i = 0; i < 3; ++i) {
+        entry.local[i] = (local != NULL && i < dim) ? local[i] : 0;
+    }
+
+    AddTuningEntry(device, &entry);
+
+    // whole table is written, so the file holds one entry per key
+    if (cache_path != NULL) {
+        char path[1024];
+        GetCacheFilePath(GetDeviceKey(device->id), "tuning", path, sizeof(path));
+
+        FILE* file = fopen(path, "wb");
+        if (file != NULL) {
+            fwrite(device->tuning, sizeof(tuning_entry), device->tuning_count, file);
+            fclose(file);
+        }
+    }
+}
+
+// uses tuned work-group size if local size isn't specified
+static cl_int EnqueueKernel(kernel_data* kd, const dispatch_data* dd, cl_uint wait_count, const cl_event* wait, cl_event* event)
+{
+    const size_t* local = dd->has_local ? dd->local : NULL;
+    size_t tuned[3];
+
+    LoadTuning(kd->device);
+
+    if (local == NULL && kd->device->tuning_count > 0) {
+        tuning_entry* entry = FindTuning(kd->device, GetTuningKey(kd, dd));
+        if (entry != NULL && entry->local[0] != 0) {
+            for (cl_uint i = 0; i < dd->dim; ++i) {
+                tuned[i] = entry->local[i];
+            }
+
+            // size tuned with padding can't be used for unpadded run of an odd size
+            if (dd->pad || IsDivisible(dd->dim, dd->global, tuned)) {
+                local = tuned;
+            }
+        }
+    }
+
+    if (dd->extent_arg >= 0) {
+        SetExtentArg(kd, dd);
+    }
+
+    size_t padded[3];
+    const size_t* global = dd->pad ? PadGlobal(dd->dim, dd->global, local, padded) : dd->global;
+    const size_t* offset = dd->has_offset ? dd->offset : NULL;
+
+    cl_uint rings = 0;
+    cl_uint uploads = 0;
+    for (cl_uint i = 0; i < kd->args_count; ++i) {
+        ReleaseUpload(&kd->buffers[i], false);
+        rings += kd->buffers[i].ring != NULL ? 1 : 0;
+        uploads += kd->buffers[i].upload != NULL ? 1 : 0;
+    }
+
+    if (rings == 0 && uploads == 0) {
+        return clEnqueueNDRangeKernel(kd->device->queue, kd->kernel, dd->dim, offset, global, local, wait_count, wait, event);
+    }
+
+    // bind current slots, kernel waits for their uploads and fences them against the next ones.
+    // kernel also waits for non-blocking uploads of pooled arguments
+    cl_event* events = (cl_event*)malloc(sizeof(cl_event) * (wait_count + rings + uploads));
+    cl_uint events_count = 0;
+    for (cl_uint i = 0; i < wait_count; ++i) {
+        events[events_count++] = wait[i];
+    }
+
+    for (cl_uint i = 0; i < kd->args_count; ++i) {
+        if (kd->buffers[i].upload != NULL) {
+            events[events_count++] = kd->buffers[i].upload;
+        }
+
+        ring_data* ring = kd->buffers[i].ring;
+        if (ring != NULL) {
+            ring_slot* slot = &ring->slots[ring->current];
+            clSetKernelArg(kd->kernel, i, sizeof(cl_mem), &slot->mem);
+            if (slot->upload != NULL) {
+                events[events_count++] = slot->upload;
+            }
+        }
+    }
+
+    cl_event own = NULL;
+    cl_int status = clEnqueueNDRangeKernel(kd->device->queue, kd->kernel, dd->dim, offset, global, local, events_count, events_count > 0 ? events : NULL, &own);
+    free(events);
+
+    if (status != CL_SUCCESS) {
+        return status;
+    }
+
+    for (cl_uint i = 0; i < kd->args_count; ++i) {
+        ring_data* ring = kd->buffers[i].ring;
+        if (ring != NULL) {
+            ring_slot* slot = &ring->slots[ring->current];
+            if (slot->fence != NULL) {
+                clReleaseEvent(slot->fence);
+            }
+            clRetainEvent(own);
+            slot->fence = own;
+        }
+    }
+
+    if (event != NULL) {
+        *event = own;
+    }else {
+        clReleaseEvent(own);
+    }
+
+    return status;
+}
+
+// returns execution time of the fastest of iterations runs, or negative value on error
+static double BenchmarkKernel(kernel_data* kd, const dispatch_data* dd, const size_t* local, int iterations)
+{
+    using namespace std::chrono;
+
+    double best = -1;
+
+    size_t padded[3];
+    cl_uint dim = dd->dim;
+    const size_t* global = dd->pad ? PadGlobal(dim, dd->global, local, padded) : dd->global;
+    const size_t* offset = dd->has_offset ? dd->offset : NULL;
+
+    for (cl_uint i = 0; i < kd->args_count; ++i) {
+        ReleaseUpload(&kd->buffers[i], true); // runs below don't wait for uploads of pooled arguments
+    }
+
+    for (int i = 0; i < iterations; ++i) {
+        cl_event event = NULL;
+        steady_clock::time_point t1 = steady_clock::now();
+
+        if (clEnqueueNDRangeKernel(kd->device->queue, kd->kernel, dim, offset, global, local, 0, NULL, &event) != CL_SUCCESS) {
+            return -1;
+        }
+
+        clFinish(kd->device->queue);
+        double time = duration_cast< duration<double> >(steady_clock::now() - t1).count();
+
+        profile_data profile;
+        StoreProfile(event, &profile);
+        if (profile.valid) { // device time excludes launch overhead
+            time = (profile.end - profile.start) * 1e-9;
+        }
+
+        if (best < 0 || time < best) {
+            best = time;
+        }
+    }
+
+    return best;
+}
+
+// appends work-group sizes for a dimension: powers of two and multiples of preferred size,
+// without padding only sizes that divide global size are usable
+static int GetTuningCandidates(size_t global, size_t max_items, size_t preferred, bool pad, size_t* candidates, int max_count)
+{
+    int count = 0;
+    for (size_t size = 1; size <= max_items && count < max_count; size *= 2) {
+        if (pad || global % size == 0) {
+            candidates[count++] = size;
+        }
+    }
+
+    for (size_t size = preferred * 3; preferred > 1 && size <= max_items && count < max_count; size += preferred * 2) {
+        if (pad || global % size == 0) { // odd multiples, even ones are covered by powers of two for power of two preferred size
+            candidates[count++] = size;
+        }
+    }
+
+    return count;
+}
+
+static int RunKernel(lua_State* L)
+{
+    using namespace std::chrono;
+    
+    DM_LUA_STACK_CHECK(L, 1);
+
+    kernel_data* kd = (kernel_data*)luaL_checkudata(L, 1, "kernel");
+
+    dispatch_data dd;
+    CheckDispatch(L, 2, &dd);
+
+    steady_clock::time_point t1 = steady_clock::now();
+
+    OrderQueue(kd->device);
+
+    cl_event event = NULL;
+    cl_int status = EnqueueKernel(kd, &dd, 0, NULL, kd->device->profiling ? &event : NULL);
+    //dmLogInfo("execution status: %d", status);
+
+    if (status != CL_SUCCESS) {
+        return DM_LUA_ERROR("Kernel execution error.");
+    }
+
+    clFinish(kd->device->queue);
+
+    if (event != NULL) {
+        StoreProfile(event, &kd->profile[PROFILE_RUN]);
+    }
+
+    steady_clock::time_point t2 = steady_clock::now();
+    duration<double> time_span = duration_cast< duration<double> >(t2 - t1);
+    
+    lua_pushnumber(L, time_span.count());
+
+    return 1;
+}
+
+static int TuneKernel(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 2);
+
+    kernel_data* kd = (kernel_data*)luaL_checkudata(L, 1, "kernel");
+
+    dispatch_data dd;
+    CheckDispatch(L, 2, &dd);
+    int iterations = luaL_optint(L, 4, 3);
+
+    size_t max_group = 1;
+    size_t preferred = 1;
+    size_t max_items[3] = {1, 1, 1};
+    clGetKernelWorkGroupInfo(kd->kernel, kd->device->id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL);
+    clGetKernelWorkGroupInfo(kd->kernel, kd->device->id, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(preferred), &preferred, NULL);
+
+    cl_uint num;
+    clGetDeviceInfo(kd->device->id, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(num), &num, NULL);
+    size_t* dims = (size_t*)malloc(sizeof(size_t) * num);
+    clGetDeviceInfo(kd->device->id, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(size_t) * num, dims, NULL);
+    for (cl_uint i = 0; i < dd.dim && i < num; ++i) {
+        max_items[i] = dims[i] < max_group ? dims[i] : max_group;
+    }
+    free(dims);
+
+    const int max_candidates = 16;
+    size_t candidates[3][max_candidates];
+    int counts[3] = {1, 1, 1};
+    candidates[1][0] = candidates[2][0] = 1;
+
+    for (cl_uint i = 0; i < dd.dim; ++i) {
+        // only first dimension is contiguous in memory, preferred multiple applies to it
+        counts[i] = GetTuningCandidates(dd.global[i], max_items[i], i == 0 ? preferred : 1, dd.pad, candidates[i], max_candidates);
+    }
+
+    if (dd.extent_arg >= 0) {
+        SetExtentArg(kd, &dd);
+    }
+
+    OrderQueue(kd->device);
+
+    // driver's choice is the baseline
+    double best_time = BenchmarkKernel(kd, &dd, NULL, iterations);
+    bool found = false;
+    size_t best[3];
+
+    for (int x = 0; x < counts[0]; ++x) {
+        for (int y = 0; y < counts[1]; ++y) {
+            for (int z = 0; z < counts[2]; ++z) {
+                size_t local[3] = {candidates[0][x], candidates[1][y], candidates[2][z]};
+                size_t group = local[0] * local[1] * local[2];
+
+                // tiny groups leave most of the hardware idle, skip them if bigger ones are possible
+                if (group > max_group || (group < preferred && group < max_group)) {
+                    continue;
+                }
+
+                double time = BenchmarkKernel(kd, &dd, local, iterations);
+                if (time >= 0 && (best_time < 0 || time < best_time)) {
+                    best_time = time;
+                    memcpy(best, local, sizeof(best));
+                    found = true;
+                }
+            }
+        }
+    }
+
+    if (best_time < 0) {
+        return DM_LUA_ERROR("Kernel execution error.");
+    }
+
+    AddTuning(kd->device, GetTuningKey(kd, &dd), found ? best : NULL, dd.dim);
+
+    if (found) {
+        lua_newtable(L);
+        for (cl_uint i = 0; i < dd.dim; ++i) {
+            lua_pushnumber(L, best[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+    }else {
+        lua_pushnil(L);
+    }
+
+    lua_pushnumber(L, best_time);
+
+    return 2;
+}
+
+static int Event_destroy(lua_State* L){
+    event_data* data = (event_data*)luaL_checkudata(L, 1, "event");
+    clReleaseEvent(data->event);
+    return 0;
+}
+
+static int EventIsComplete(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    event_data* data = (event_data*)luaL_checkudata(L, 1, "event");
+
+    cl_int status = CL_QUEUED;
+    clGetEventInfo(data->event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+    lua_pushboolean(L, status == CL_COMPLETE || status < 0); // negative status means command was terminated
+
+    return 1;
+}
+
+static int EventWait(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    event_data* data = (event_data*)luaL_checkudata(L, 1, "event");
+    lua_pushboolean(L, clWaitForEvents(1, &data->event) == CL_SUCCESS);
+
+    return 1;
+}
+
+static int EventGetProfilingInfo(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    event_data* data = (event_data*)luaL_checkudata(L, 1, "event");
+
+    profile_data profile;
+    clRetainEvent(data->event); // StoreProfile releases it
+    StoreProfile(data->event, &profile);
+    PushProfile(L, &profile);
+
+    return 1;
+}
+
+// pushes event userdata, takes ownership of the event
+static void PushEvent(lua_State* L, cl_event event)
+{
+    event_data* data = (event_data*)(lua_newuserdata(L, sizeof(event_data)));
+    data->event = event;
+
+    luaL_newmetatable(L, "event");
+    static const luaL_Reg functions[] =
+    {
+        {"__gc", Event_destroy},
+        {"is_complete", EventIsComplete},
+        {"wait", EventWait},
+        {"get_profiling_info", EventGetProfilingInfo},
+        {0, 0}
+    };
+    luaL_register(L, NULL, functions);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -1, "__index");
+    lua_setmetatable(L, -2);
+}
+
+struct wait_list {
+    cl_event* events;
+    cl_uint count;
+    cl_event marker; // created for implicit dependency, released with the list
+};
+
+// events listed in wait field of options table at index. Without the list, command enqueued
+// into in-order queue waits for everything enqueued before into the other queue of the device
+static void GetWaitList(lua_State* L, int index, device_data* device, cl_command_queue other, wait_list* wl)
+{
+    wl->events = NULL;
+    wl->count = 0;
+    wl->marker = NULL;
+
+    bool given = false;
+    if (lua_istable(L, index)) {
+        lua_getfield(L, index, "wait");
+        given = lua_istable(L, -1);
+        wl->count = given ? lua_objlen(L, -1) : 0;
+
+        if (wl->count > 0) {
+            wl->events = (cl_event*)malloc(sizeof(cl_event) * wl->count);
+            for (cl_uint i = 0; i < wl->count; ++i) {
+                lua_rawgeti(L, -1, i + 1);
+                event_data* data = (event_data*)luaL_checkudata(L, -1, "event");
+                wl->events[i] = data->event;
+                lua_pop(L, 1);
+            }
+        }
+        lua_pop(L, 1);
+    }
+
+    if (!given && !device->out_of_order) {
+        clEnqueueMarkerWithWaitList(other, 0, NULL, &wl->marker);
+        clFlush(other); // marker must be submitted for the command waiting on it to progress
+        wl->events = &wl->marker;
+        wl->count = 1;
+    }
+}
+
+static void ReleaseWaitList(wait_list* wl)
+{
+    if (wl->marker != NULL) {
+        clReleaseEvent(wl->marker);
+    }else {
+        free(wl->events);
+    }
+}
+
+// callback at index (if not 0) will be called from extension update once the event completes
+static pending_data* AddPendingCallback(lua_State* L, int index, cl_event event, read_data* read)
+{
+    pending_data pd;
+    pd.callback = index != 0 ? dmScript::CreateCallback(L, index) : NULL;
+    pd.read = read;
+    pd.build = NULL;
+    pd.host = NULL;
+    pd.event = event;
+    clRetainEvent(event);
+
+    lua_pushvalue(L, -1); // event userdata on top of the stack
+    pd.ref = dmScript::Ref(L, LUA_REGISTRYINDEX);
+
+    if (pending.Full()) {
+        pending.OffsetCapacity(8);
+    }
+    pending.Push(pd);
+    return &pending.Back();
+}
+
+static int RunKernelAsync(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    kernel_data* kd = (kernel_data*)luaL_checkudata(L, 1, "kernel");
+
+    dispatch_data dd;
+    CheckDispatch(L, 2, &dd);
+
+    int callback = lua_isfunction(L, lua_gettop(L)) ? lua_gettop(L) : 0;
+
+    wait_list wait;
+    GetWaitList(L, 5, kd->device, kd->device->transfer, &wait);
+
+    cl_event event;
+    cl_int status = EnqueueKernel(kd, &dd, wait.count, wait.events, &event);
+    ReleaseWaitList(&wait);
+
+    if (status != CL_SUCCESS) {
+        return DM_LUA_ERROR("Kernel execution error.");
+    }
+
+    clFlush(kd->device->queue);
+
+    PushEvent(L, event);
+
+    if (callback != 0) {
+        AddPendingCallback(L, callback, event, NULL);
+    }
+
+    return 1;
+}
+
+static int JobProgress(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    slice_job_data* job = (slice_job_data*)luaL_checkudata(L, 1, "job");
+    size_t total = job->dispatch.global[job->dispatch.dim - 1];
+    lua_pushnumber(L, total > 0 ? (double)job->done / total : 1);
+
+    return 1;
+}
+
+static int JobIsComplete(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    slice_job_data* job = (slice_job_data*)luaL_checkudata(L, 1, "job");
+    lua_pushboolean(L, !job->running);
+
+    return 1;
+}
+
+// tiles already executed stay, callback is called with success = false on the next update
+static int JobCancel(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    slice_job_data* job = (slice_job_data*)luaL_checkudata(L, 1, "job");
+    job->cancelled = true;
+
+    return 0;
+}
+
+static int RunKernelSliced(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    kernel_data* kd = (kernel_data*)luaL_checkudata(L, 1, "kernel");
+
+    dispatch_data dd;
+    CheckDispatch(L, 2, &dd);
+
+    int last = dd.dim - 1;
+    size_t granularity = dd.has_local ? dd.local[last] : 1;
+    if (!dd.pad && dd.global[last] % granularity != 0) {
+        return DM_LUA_ERROR("Global size must be a multiple of local size, use pad option.");
+    }
+
+    double budget = 0.004;
+    if (lua_istable(L, 5)) {
+        lua_getfield(L, 5, "budget");
+        if (lua_isnumber(L, -1)) {
+            budget = lua_tonumber(L, -1) * 0.001;
+        }
+        lua_pop(L, 1);
+    }
+
+    if (budget <= 0) {
+        return DM_LUA_ERROR("Budget must be positive.");
+    }
+
+    int callback = lua_isfunction(L, lua_gettop(L)) ? lua_gettop(L) : 0;
+
+    slice_job_data* job = (slice_job_data*)lua_newuserdata(L, sizeof(slice_job_data));
+    job->kernel = kd;
+    job->dispatch = dd;
+    job->done = 0;
+    job->granularity = granularity;
+    job->budget = budget;
+    job->rate = 0;
+    job->cancelled = false;
+    job->running = true;
+    job->callback = callback != 0 ? dmScript::CreateCallback(L, callback) : NULL;
+
+    luaL_newmetatable(L, "job");
+    static const luaL_Reg functions[] =
+    {
+        {"progress", JobProgress},
+        {"is_complete", JobIsComplete},
+        {"cancel", JobCancel},
+        {0, 0}
+    };
+    luaL_register(L, NULL, functions);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -1, "__index");
+    lua_setmetatable(L, -2);
+
+    lua_pushvalue(L, 1);
+    job->kernel_ref = dmScript::Ref(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, -1);
+    job->ref = dmScript::Ref(L, LUA_REGISTRYINDEX);
+
+    if (jobs.Full()) {
+        jobs.OffsetCapacity(4);
+    }
+    jobs.Push(job);
+
+    return 1;
+}
+
+// runs tiles of the job until the frame budget is used, returns false on error
+static bool StepJob(slice_job_data* job)
+{
+    using namespace std::chrono;
+
+    const dispatch_data* dd = &job->dispatch;
+    int last = dd->dim - 1;
+    size_t total = dd->global[last];
+    size_t base = dd->has_offset ? dd->offset[last] : 0;
+
+    steady_clock::time_point t0 = steady_clock::now();
+    double elapsed = 0;
+
+    OrderQueue(job->kernel->device);
+
+    bool first = true;
+    while (job->done < total) {
+        // first tile is a single granule to measure throughput
+        size_t size = job->granularity;
+        if (job->rate > 0) {
+            size_t fit = (size_t)(job->rate * (job->budget - elapsed)) / job->granularity * job->granularity;
+            if (fit < job->granularity && !first) {
+                break;
+            }
+            size = fit > job->granularity ? fit : job->granularity; // granule slower than budget still progresses every frame
+        }
+        first = false;
+        if (size > total - job->done) {
+            size = total - job->done;
+        }
+
+        dispatch_data tile = *dd;
+        tile.global[last] = size;
+        tile.has_offset = true;
+        for (int i = 0; i < last; ++i) {
+            tile.offset[i] = dd->has_offset ? dd->offset[i] : 0;
+        }
+        tile.offset[last] = base + job->done;
+
+        steady_clock::time_point t1 = steady_clock::now();
+
+        if (EnqueueKernel(job->kernel, &tile, 0, NULL, NULL) != CL_SUCCESS) {
+            return false;
+        }
+        clFinish(job->kernel->device->queue);
+
+        steady_clock::time_point t2 = steady_clock::now();
+        double time = duration_cast< duration<double> >(t2 - t1).count();
+        elapsed = duration_cast< duration<double> >(t2 - t0).count();
+        job->done += size;
+
+        // smoothed, so a single slow frame doesn't shrink tiles too much
+        double rate = size / (time > 1e-6 ? time : 1e-6);
+        job->rate = job->rate > 0 ? job->rate * 0.5 + rate * 0.5 : rate;
+
+        if (elapsed >= job->budget) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+static void ReleaseJob(lua_State* L, slice_job_data* job)
+{
+    if (job->callback != NULL) {
+        dmScript::DestroyCallback(job->callback);
+        job->callback = NULL;
+    }
+
+    job->running = false;
+    dmScript::Unref(L, LUA_REGISTRYINDEX, job->kernel_ref);
+    dmScript::Unref(L, LUA_REGISTRYINDEX, job->ref); // job userdata can be collected after this
+}
+
+static void CompleteJob(lua_State* L, slice_job_data* job, bool success)
+{
+    if (job->callback != NULL) {
+        lua_State* cL = dmScript::GetCallbackLuaContext(job->callback);
+        DM_LUA_STACK_CHECK(cL, 0);
+
+        if (dmScript::SetupCallback(job->callback)) {
+            lua_rawgeti(cL, LUA_REGISTRYINDEX, job->ref);
+            lua_pushboolean(cL, success);
+            dmScript::PCall(cL, 3, 0);
+            dmScript::TeardownCallback(job->callback);
+        }
+    }
+
+    ReleaseJob(L, job);
+}
+
+template <typename T>
+void Unpack(lua_State* L, const T* output, size_t count, T* values, uint32_t stride) 
+{
+    if (values != NULL) {
+        for (int i = 0; i < count; i++) {
+            values[0] = output[i];
+            values += stride;
+        }
+        return;
+    }
+
+    lua_newtable(L);
+
+    for (int i = 0; i < count; i++) {
+        lua_pushnumber(L, output[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+}
+
+template <typename T, typename CLT>
+void UnpackVectors(lua_State* L, const CLT* output, size_t count, T *values, uint32_t stride) 
+{
+    if (values != NULL) {
+        for (uint i = 0; i < count; i++) {
+            values[0] = output[i].x;
+            values[1] = output[i].y;
+            values[2] = output[i].z;
+
+            values += stride;
+        }
+        return;
+    }
+
+    lua_newtable(L);
+
+    for (int i = 0; i < count; i++) {
+        lua_newtable(L);
+
+        lua_pushnumber(L, output[i].x);
+        lua_rawseti(L, -2, 1);
+        lua_pushnumber(L, output[i].y);
+        lua_rawseti(L, -2, 2);
+        lua_pushnumber(L, output[i].z);
+        lua_rawseti(L, -2, 3);
+
+        lua_rawseti(L, -2, i + 1);
+    }
+}
+
+// copies data read from device into dmBuffer stream values, or pushes it as lua table if values is NULL
+static void UnpackMem(lua_State* L, BUFFER_TYPE type, const void* output, size_t count, void* values, uint32_t stride)
+{
+    switch(type) {
+        case float3: 
+            UnpackVectors<float, cl_float3>(L, (const cl_float3*)output, count, (float*)values, stride);
+            break;
+        case uchar3: 
+            UnpackVectors<unsigned char, cl_uchar3>(L, (const cl_uchar3*)output, count, (unsigned char*)values, stride);
+            break;
+        case uint3: 
+            UnpackVectors<uint32_t, cl_uint3>(L, (const cl_uint3*)output, count, (uint32_t*)values, stride);
+            break;
+        case uchar1: 
+            Unpack<unsigned char>(L, (const unsigned char*)output, count, (unsigned char*)values, stride);
+            break;
+        case uint1: 
+            Unpack<uint32_t>(L, (const uint32_t*)output, count, (uint32_t*)values, stride);
+            break;
+        case float1: 
+            Unpack<float>(L, (const float*)output, count, (float*)values, stride);
+            break;
+    }
+}
+
+// true if read with count at index arg returns lua table, i.e. no dmBuffer follows count and optional offset
+static bool IsReadToTable(lua_State* L, int arg)
+{
+    int buffer = lua_isnumber(L, arg + 1) ? arg + 2 : arg + 1;
+    return lua_isnoneornil(L, buffer);
+}
+
+// reads count items (argument at index arg) starting from optional offset (arg + 1) from mem
+// either into a lua table or into dmBuffer stream (next two arguments) at the same offset
+static int ReadMem(lua_State* L, int arg, device_data* device, cl_mem mem, BUFFER_TYPE type, profile_data* profile)
+{
+    int ret = IsReadToTable(L, arg) ? 1 : 0;
+    size_t count = luaL_checkint(L, arg);
+
+    size_t offset = 0;
+    if (lua_isnumber(L, arg + 1)) {
+        offset = lua_tointeger(L, arg + 1);
+        arg++;
+    }
+
+    size_t mem_size = 0;
+    if (mem == NULL || clGetMemObjectInfo(mem, CL_MEM_SIZE, sizeof(mem_size), &mem_size, NULL) != CL_SUCCESS) {
+        return luaL_error(L, "can't get size of device buffer");
+    }
+
+    if ((offset + count) * GetElementSize(type) > mem_size) {
+        return luaL_error(L, "range is out of device buffer");
+    }
+
+    void* values = NULL;
+    uint32_t stride = 0;
+    
+    if (ret == 0) { //return data in dmBuffer
+        dmBuffer::HBuffer output = dmScript::CheckBufferUnpack(L, arg + 1);
+        dmhash_t streamName = dmScript::CheckHashOrString(L, arg + 2);
+
+        uint32_t stream_count = 0;
+        dmBuffer::Result dataResult = dmBuffer::GetStream(output, streamName, (void**)&values, &stream_count, NULL, &stride);
+        if (dataResult != dmBuffer::RESULT_OK) {
+            return luaL_error(L, "can't get stream in output buffer");
+        }
+
+        if (offset + count > stream_count) {
+            return luaL_error(L, "range is out of output stream");
+        }
+
+        // every read item goes to its own stream item
+        values = (uint8_t*)values + offset * stride * GetComponentSize(type);
+    }
+
+    size_t size = GetElementSize(type) * count;
+    void* output = AcquireStaging(device, size);
+    OrderQueue(device);
+
+    cl_event event = NULL;
+    cl_int status = clEnqueueReadBuffer(device->queue, mem, CL_TRUE, GetElementSize(type) * offset, size, output, 0, NULL, device->profiling ? &event : NULL);
+    if (status != CL_SUCCESS) {
+        return luaL_error(L, "Read error.");
+    }
+
+    UnpackMem(L, type, output, count, values, stride);
+
+    if (event != NULL) {
+        StoreProfile(event, profile);
+    }
+
+    return ret;
+}
+
+// same as ReadMem, but doesn't block: data is delivered to dmBuffer stream and/or callback from extension update
+static int ReadMemAsync(lua_State* L, int arg, device_data* device, cl_mem mem, BUFFER_TYPE type)
+{
+    size_t count = luaL_checkint(L, arg);
+
+    int top = lua_gettop(L);
+    int callback = lua_isfunction(L, top) ? top : 0;
+
+    dmBuffer::HBuffer buffer = 0;
+    dmhash_t streamName = 0;
+    bool to_buffer = lua_isuserdata(L, arg + 1);
+    int options = to_buffer ? arg + 3 : arg + 1;
+
+    if (to_buffer) {
+        buffer = dmScript::CheckBufferUnpack(L, arg + 1);
+        streamName = dmScript::CheckHashOrString(L, arg + 2);
+
+        void* values = NULL;
+        uint32_t stream_count = 0;
+        if (dmBuffer::GetStream(buffer, streamName, &values, &stream_count, NULL, NULL) != dmBuffer::RESULT_OK) {
+            return luaL_error(L, "can't get stream in output buffer");
+        }
+
+        if (count > stream_count) {
+            return luaL_error(L, "count is out of output stream");
+        }
+    }else if (callback == 0) {
+        return luaL_error(L, "either output buffer or callback expected");
+    }
+
+    size_t size = GetElementSize(type) * count;
+    void* output = malloc(size);
+
+    wait_list wait;
+    GetWaitList(L, options, device, device->queue, &wait);
+
+    cl_event event;
+    cl_int status = clEnqueueReadBuffer(device->transfer, mem, CL_FALSE, 0, size, output, wait.count, wait.events, &event);
+    ReleaseWaitList(&wait);
+
+    if (status != CL_SUCCESS) {
+        free(output);
+        return luaL_error(L, "Read error.");
+    }
+
+    clFlush(device->transfer);
+
+    read_data* read = (read_data*)malloc(sizeof(read_data));
+    read->output = output;
+    read->count = count;
+    read->type = type;
+    read->buffer = buffer;
+    read->stream = streamName;
+    read->buffer_ref = LUA_NOREF;
+
+    if (to_buffer) {
+        lua_pushvalue(L, arg + 1);
+        read->buffer_ref = dmScript::Ref(L, LUA_REGISTRYINDEX);
+    }
+
+    PushEvent(L, event);
+    AddPendingCallback(L, callback, event, read);
+
+    return 1;
+}
+
+// raises error unless kernel argument at idx is bound to a device buffer
+static void CheckReadableArg(lua_State* L, kernel_data* kd, int idx)
+{
+    if (idx < 0 || (cl_uint)idx >= kd->args_count) {
+        luaL_error(L, "Argument isn't a buffer.");
+    }
+
+    if (kd->buffers[idx].ring != NULL) {
+        luaL_error(L, "Ring buffer argument can't be read.");
+    }
+
+    if (kd->buffers[idx].mem == NULL) {
+        luaL_error(L, "Argument isn't a buffer.");
+    }
+}
+
+static int ReadKernelBuffer(lua_State* L) 
+{
+    int ret = IsReadToTable(L, 3) ? 1 : 0;
+    DM_LUA_STACK_CHECK(L, ret);
+
+    kernel_data* kd = (kernel_data*)luaL_checkudata(L, 1, "kernel");
+    int idx = luaL_checkint(L, 2) - 1;
+    CheckReadableArg(L, kd, idx);
+
+    ReleaseUpload(&kd->buffers[idx], true); // pooled argument not uploaded yet if no kernel ran
+
+    return ReadMem(L, 3, kd->device, kd->buffers[idx].mem, kd->buffers[idx].type, &kd->profile[PROFILE_READ]);
+}
+
+static int ReadKernelBufferAsync(lua_State* L) 
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    kernel_data* kd = (kernel_data*)luaL_checkudata(L, 1, "kernel");
+    int idx = luaL_checkint(L, 2) - 1;
+    CheckReadableArg(L, kd, idx);
+
+    return ReadMemAsync(L, 3, kd->device, kd->buffers[idx].mem, kd->buffers[idx].type);
+}
+
+static int ReadBufferAsync(lua_State* L) 
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    mem_data* md = (mem_data*)luaL_checkudata(L, 1, "clbuffer");
+
+    return ReadMemAsync(L, 2, md->device, md->mem, md->type);
+}
+
+static int ReadBuffer(lua_State* L) 
+{
+    int ret = IsReadToTable(L, 2) ? 1 : 0;
+    DM_LUA_STACK_CHECK(L, ret);
+
+    mem_data* md = (mem_data*)luaL_checkudata(L, 1, "clbuffer");
+
+    return ReadMem(L, 2, md->device, md->mem, md->type, &md->profile[PROFILE_READ]);
+}
+
+static int WriteBuffer(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    mem_data* md = (mem_data*)luaL_checkudata(L, 1, "clbuffer");
+    dmBuffer::HBuffer input = dmScript::CheckBufferUnpack(L, 2);
+    dmhash_t streamName = dmScript::CheckHashOrString(L, 3);
+
+    stream_data stream;
+    if (!GetStreamData(input, streamName, &stream)) {
+        return DM_LUA_ERROR("can't get stream");
+    }
+
+    if (stream.type != md->type) {
+        return DM_LUA_ERROR("stream type doesn't match buffer type");
+    }
+
+    // optional range in stream items: source offset, destination offset, count
+    size_t src_offset = luaL_optint(L, 4, 0);
+    size_t dst_offset = luaL_optint(L, 5, 0);
+    if (src_offset > stream.count) {
+        return DM_LUA_ERROR("offset is out of stream");
+    }
+
+    size_t count = luaL_optint(L, 6, stream.count - src_offset);
+    if (src_offset + count > stream.count) {
+        return DM_LUA_ERROR("range is out of stream");
+    }
+
+    stream.values = (uint8_t*)stream.values + src_offset * stream.stride * GetComponentSize(stream.type);
+    stream.count = count;
+
+    size_t per_item = IsVectorType(stream.type) ? 1 : stream.components;
+    if (dst_offset * per_item + GetStreamElements(&stream) > md->count) {
+        return DM_LUA_ERROR("stream doesn't fit into buffer");
+    }
+
+    UploadStream(md->device, &md->mem, &stream, 0, dst_offset * per_item * GetElementSize(md->type), &md->profile[PROFILE_UPLOAD]);
+
+    return 0;
+}
+
+// non-blocking upload, stream is copied so dmBuffer can be changed right away
+static int WriteBufferAsync(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    mem_data* md = (mem_data*)luaL_checkudata(L, 1, "clbuffer");
+    dmBuffer::HBuffer input = dmScript::CheckBufferUnpack(L, 2);
+    dmhash_t streamName = dmScript::CheckHashOrString(L, 3);
+
+    int top = lua_gettop(L);
+    int callback = lua_isfunction(L, top) ? top : 0;
+
+    stream_data stream;
+    if (!GetStreamData(input, streamName, &stream)) {
+        return DM_LUA_ERROR("can't get stream");
+    }
+
+    if (stream.type != md->type) {
+        return DM_LUA_ERROR("stream type doesn't match buffer type");
+    }
+
+    size_t count = GetStreamElements(&stream);
+    if (count > md->count) {
+        return DM_LUA_ERROR("stream doesn't fit into buffer");
+    }
+
+    size_t size = GetElementSize(stream.type) * count;
+
+    void* data = malloc(size);
+    PackStream(&stream, data);
+
+    wait_list wait;
+    GetWaitList(L, 4, md->device, md->device->queue, &wait);
+
+    cl_event event;
+    cl_int status = clEnqueueWriteBuffer(md->device->transfer, md->mem, CL_FALSE, 0, size, data, wait.count, wait.events, &event);
+    ReleaseWaitList(&wait);
+
+    if (status != CL_SUCCESS) {
+        free(data);
+        return DM_LUA_ERROR("Write error.");
+    }
+
+    clFlush(md->device->transfer);
+
+    PushEvent(L, event);
+    AddPendingCallback(L, callback, event, NULL)->host = data;
+
+    return 1;
+}
+
+static int KernelGetProfilingInfo(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    kernel_data* kd = (kernel_data*)luaL_checkudata(L, 1, "kernel");
+
+    lua_newtable(L);
+    PushProfile(L, &kd->profile[PROFILE_RUN]);
+    lua_setfield(L, -2, "run");
+    PushProfile(L, &kd->profile[PROFILE_UPLOAD]);
+    lua_setfield(L, -2, "upload");
+    PushProfile(L, &kd->profile[PROFILE_READ]);
+    lua_setfield(L, -2, "read");
+
+    return 1;
+}
+
+static int BufferGetProfilingInfo(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    mem_data* md = (mem_data*)luaL_checkudata(L, 1, "clbuffer");
+
+    lua_newtable(L);
+    PushProfile(L, &md->profile[PROFILE_UPLOAD]);
+    lua_setfield(L, -2, "upload");
+    PushProfile(L, &md->profile[PROFILE_READ]);
+    lua_setfield(L, -2, "read");
+
+    return 1;
+}
+
+static int CreateKernel(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    const char* name = luaL_checkstring(L, -1);
+    program_data* p = (program_data*)luaL_checkudata(L, 1, "program"); 
+
+    cl_int err;
+    cl_kernel kernel = clCreateKernel(p->program, name, &err);
+
+    if (err != 0) {
+        return DM_LUA_ERROR("Can't create kernel.");
+    }
+
+    kernel_data* data = (kernel_data*)(lua_newuserdata(L, sizeof(kernel_data)));
+    data->kernel = kernel;
+    data->args_count = 0;
+    ClearProfile(data->profile);
+    data->buffers = NULL;
+    data->device = p->device;
+
+    HashState64 state;
+    dmHashInit64(&state, false);
+    dmHashUpdateBuffer64(&state, &p->key, sizeof(p->key));
+    dmHashUpdateBuffer64(&state, name, strlen(name));
+    data->key = dmHashFinal64(&state);
+
+    luaL_newmetatable(L, "kernel");
+    static const luaL_Reg functions[] =
+    {
+        {"__gc", Kernel_destroy},
+        {"set_arg_buffer", SetKernelArgBuffer},
+        {"set_arg_int", SetKernelArgInt},
+        {"set_arg_float", SetKernelArgFloat},
+        {"set_arg_vec3", SetKernelArgVec3},
+        {"set_arg_null", SetKernelArgNull},
+        {"set_arg_mem", SetKernelArgMem},
+        {"set_arg_ring", SetKernelArgRing},
+        {"run", RunKernel},
+        {"run_async", RunKernelAsync},
+        {"run_sliced", RunKernelSliced},
+        {"tune", TuneKernel},
+        {"read", ReadKernelBuffer},
+        {"read_async", ReadKernelBufferAsync},
+        {"get_profiling_info", KernelGetProfilingInfo},
+        {0, 0}
+    };
+    luaL_register(L, NULL, functions);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -1, "__index");
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+// device can be passed either as table returned by get_devices or as its id
+static device_data* CheckDevice(lua_State* L, int index)
+{
+    device_data* device = NULL;
+    if (lua_istable(L, index)) {
+        lua_getfield(L, index, "id");
+        device = *(device_data**)luaL_checkudata(L, -1, "device"); 
+        lua_pop(L, 1);
+    }else {
+        device = *(device_data**)luaL_checkudata(L, index, "device"); 
+    }
+
+    InitDeviceContext(device);
+
+    return device;
+}
+
+static int Ring_destroy(lua_State* L)
+{
+    ring_data* ring = (ring_data*)luaL_checkudata(L, 1, "ringbuffer");
+
+    for (uint32_t i = 0; i < ring->slots_count; ++i) {
+        ring_slot* slot = &ring->slots[i];
+        if (slot->upload != NULL) {
+            clWaitForEvents(1, &slot->upload); // device mustn't read from released host memory
+            clReleaseEvent(slot->upload);
+        }
+        if (slot->fence != NULL) {
+            clReleaseEvent(slot->fence);
+        }
+        clReleaseMemObject(slot->mem);
+        free(slot->host);
+    }
+    free(ring->slots);
+
+    return 0;
+}
+
+// uploads stream into the next slot, doesn't block unless the slot's previous upload is still in flight
+static int RingWrite(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    ring_data* ring = (ring_data*)luaL_checkudata(L, 1, "ringbuffer");
+    dmBuffer::HBuffer input = dmScript::CheckBufferUnpack(L, 2);
+    dmhash_t streamName = dmScript::CheckHashOrString(L, 3);
+
+    stream_data stream;
+    if (!GetStreamData(input, streamName, &stream)) {
+        return DM_LUA_ERROR("can't get stream");
+    }
+
+    if (stream.type != ring->type) {
+        return DM_LUA_ERROR("stream type doesn't match buffer type");
+    }
+
+    size_t count = GetStreamElements(&stream);
+    if (count > ring->count) {
+        return DM_LUA_ERROR("stream doesn't fit into buffer");
+    }
+
+    uint32_t next = (ring->current + 1) % ring->slots_count;
+    ring_slot* slot = &ring->slots[next];
+
+    if (slot->upload != NULL) { // host memory of the slot is reused
+        clWaitForEvents(1, &slot->upload);
+        clReleaseEvent(slot->upload);
+        slot->upload = NULL;
+    }
+
+    PackStream(&stream, slot->host);
+
+    // waits on device for the last kernel reading the slot, not on host
+    cl_event event;
+    cl_int status = clEnqueueWriteBuffer(ring->device->transfer, slot->mem, CL_FALSE, 0, GetElementSize(ring->type) * count, slot->host,
+        slot->fence != NULL ? 1 : 0, slot->fence != NULL ? &slot->fence : NULL, &event);
+
+    if (status != CL_SUCCESS) {
+        return DM_LUA_ERROR("Write error.");
+    }
+
+    clFlush(ring->device->transfer);
+    slot->upload = event;
+    ring->current = next;
+
+    return 0;
+}
+
+static int CreateRingBuffer(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    device_data* device = CheckDevice(L, 1);
+    size_t count = luaL_checkint(L, 2);
+    int type = luaL_checkint(L, 3);
+    int slots = luaL_optint(L, 4, 3);
+
+    if (type < float1 || type > uint3) {
+        return DM_LUA_ERROR("unknown buffer type");
+    }
+
+    if (slots < 1) {
+        return DM_LUA_ERROR("at least one slot expected");
+    }
+
+    ring_data* ring = (ring_data*)(lua_newuserdata(L, sizeof(ring_data)));
+    ring->device = device;
+    ring->type = (BUFFER_TYPE)type;
+    ring->count = count;
+    ring->slots_count = 0;
+    ring->slots = (ring_slot*)malloc(sizeof(ring_slot) * slots);
+    ring->current = slots - 1; // first upload goes to the first slot
+
+    luaL_newmetatable(L, "ringbuffer");
+    static const luaL_Reg functions[] =
+    {
+        {"__gc", Ring_destroy},
+        {"write", RingWrite},
+        {0, 0}
+    };
+    luaL_register(L, NULL, functions);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -1, "__index");
+    lua_setmetatable(L, -2);
+
+    size_t size = GetElementSize((BUFFER_TYPE)type) * count;
+
+    for (int i = 0; i < slots; ++i) {
+        cl_int err;
+        cl_mem mem = clCreateBuffer(device->context, CL_MEM_READ_ONLY, size, NULL, &err);
+
+        if (err != CL_SUCCESS) {
+            dmLogInfo("clCreateBuffer failed: %d", err);
+            return DM_LUA_ERROR("Can't create buffer.");
+        }
+
+        ring_slot* slot = &ring->slots[ring->slots_count++];
+        slot->mem = mem;
+        slot->host = malloc(size);
+        slot->upload = NULL;
+        slot->fence = NULL;
+    }
+
+    return 1;
+}
+
+static int CreateBuffer(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    device_data* device = CheckDevice(L, 1);
+    size_t count = luaL_checkint(L, 2);
+    int type = luaL_checkint(L, 3);
+
+    if (type < float1 || type > uint3) {
+        return DM_LUA_ERROR("unknown buffer type");
+    }
+
+    bool read = lua_isnoneornil(L, 4) ? true : lua_toboolean(L, 4);
+    bool write = lua_isnoneornil(L, 5) ? true : lua_toboolean(L, 5);
+
+    cl_int err;
+    cl_mem mem = clCreateBuffer(device->context, GetAccessFlags(read, write), GetElementSize((BUFFER_TYPE)type) * count, NULL, &err);
+
+    if (err != CL_SUCCESS) {
+        dmLogInfo("clCreateBuffer failed: %d", err);
+        return DM_LUA_ERROR("Can't create buffer.");
+    }
+
+    mem_data* data = (mem_data*)(lua_newuserdata(L, sizeof(mem_data)));
+    data->mem = mem;
+    data->type = (BUFFER_TYPE)type;
+    data->count = count;
+    ClearProfile(data->profile);
+    data->device = device;
+
+    luaL_newmetatable(L, "clbuffer");
+    static const luaL_Reg functions[] =
+    {
+        {"__gc", Mem_destroy},
+        {"write", WriteBuffer},
+        {"write_async", WriteBufferAsync},
+        {"read", ReadBuffer},
+        {"read_async", ReadBufferAsync},
+        {"get_profiling_info", BufferGetProfilingInfo},
+        {0, 0}
+    };
+    luaL_register(L, NULL, functions);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -1, "__index");
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+// program binaries are specific to source, build options, device and driver
+static uint64_t GetProgramKey(device_data* device, const char* source, const char* options)
+{
+    HashState64 state;
+    dmHashInit64(&state, false);
+    dmHashUpdateBuffer64(&state, source, strlen(source));
+
+    uint64_t device_key = GetDeviceKey(device->id);
+    dmHashUpdateBuffer64(&state, &device_key, sizeof(device_key));
+
+    if (options != NULL) {
+        dmHashUpdateBuffer64(&state, options, strlen(options));
+    }
+
+    return dmHashFinal64(&state);
+}
+
+static cl_program LoadProgramBinary(device_data* device, uint64_t key, const char* options)
+{
+    char path[1024];
+    GetCacheFilePath(key, "bin", path, sizeof(path));
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    unsigned char* binary = (unsigned char*)malloc(size > 0 ? size : 1);
+    size_t binary_size = fread(binary, 1, size, file);
+    fclose(file);
+
+    cl_program program = NULL;
+
+    if (size > 0 && binary_size == (size_t)size) {
+        cl_int binary_status, err;
+        program = clCreateProgramWithBinary(device->context, 1, &device->id, &binary_size, (const unsigned char**)&binary, &binary_status, &err);
+
+        if (err == CL_SUCCESS && binary_status == CL_SUCCESS) {
+            err = clBuildProgram(program, 1, &device->id, options, NULL, NULL);
+        }
+
+        if (err != CL_SUCCESS || binary_status != CL_SUCCESS) { // stale or corrupted binary, rebuild from source
+            dmLogInfo("cached program binary %s rejected: %d", path, err);
+            if (program != NULL) {
+                clReleaseProgram(program);
+            }
+            program = NULL;
+        }
+    }
+
+    free(binary);
+    return program;
+}
+
+static void SaveProgramBinary(cl_program program, uint64_t key)
+{
+    size_t size = 0;
+    clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL);
+    if (size == 0) {
+        return;
+    }
+
+    unsigned char* binary = (unsigned char*)malloc(size);
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL) == CL_SUCCESS) {
+        char path[1024];
+        GetCacheFilePath(key, "bin", path, sizeof(path));
+
+        FILE* file = fopen(path, "wb");
+        if (file != NULL) {
+            fwrite(binary, 1, size, file);
+            fclose(file);
+        }else {
+            dmLogWarning("can't write program binary %s", path);
+        }
+    }
+
+    free(binary);
+}
+
+static uint64_t GetSourceKey(const char* source, const char* options)
+{
+    HashState64 state;
+    dmHashInit64(&state, false);
+    dmHashUpdateBuffer64(&state, source, strlen(source) + 1);
+    if (options != NULL) {
+        dmHashUpdateBuffer64(&state, options, strlen(options));
+    }
+    return dmHashFinal64(&state);
+}
+
+static program_cache_entry* FindCacheEntry(device_data* device, uint64_t key)
+{
+    for (uint32_t i = 0; i < device->programs_count; ++i) {
+        if (device->programs[i].key == key) {
+            return &device->programs[i];
+        }
+    }
+    return NULL;
+}
+
+static cl_program FindCachedProgram(device_data* device, uint64_t key)
+{
+    program_cache_entry* entry = FindCacheEntry(device, key);
+    return entry != NULL ? entry->program : NULL;
+}
+
+static void AddCachedProgram(device_data* device, uint64_t key, cl_program program)
+{
+    if (FindCacheEntry(device, key) != NULL) { // builds sharing one compile can complete in any order
+        return;
+    }
+
+    device->programs = (program_cache_entry*)realloc(device->programs, sizeof(program_cache_entry) * (device->programs_count + 1));
+    device->programs[device->programs_count].key = key;
+    device->programs[device->programs_count].program = program;
+    device->programs[device->programs_count].refs = 0;
+    device->programs_count++;
+    clRetainProgram(program); // released with the last program userdata or with the device
+}
+
+// builds program from source, or from cached binary if disk cache is enabled
+static cl_program CompileProgram(device_data* device, const char* source, const char* options)
+{
+    uint64_t key = 0;
+
+    if (cache_path != NULL) {
+        key = GetProgramKey(device, source, options);
+        cl_program program = LoadProgramBinary(device, key, options);
+        if (program != NULL) {
+            return program;
+        }
+    }
+
+    cl_program program = clCreateProgramWithSource(device->context, 1, (const char **)&source, NULL, NULL);
+
+    cl_int status = clBuildProgram(program, 1, &device->id, options, NULL, NULL);
+
+    if(status != CL_SUCCESS) {
+        dmLogInfo("clBuildProgram failed: %d", status);
+        clReleaseProgram(program);
+        return NULL;
+    }
+
+    if (cache_path != NULL) {
+        SaveProgramBinary(program, key);
+    }
+
+    return program;
+}
+
+// identical source and options are compiled only once per device, returned program has to be released
+static cl_program BuildProgram(device_data* device, const char* source, const char* options)
+{
+    uint64_t source_key = GetSourceKey(source, options);
+    cl_program cached = FindCachedProgram(device, source_key);
+    if (cached != NULL) {
+        clRetainProgram(cached);
+        return cached;
+    }
+
+    cl_program program = CompileProgram(device, source, options);
+    if (program != NULL) {
+        AddCachedProgram(device, source_key, program);
+    }
+
+    return program;
+}
+
+static void AppendOption(char** options, const char* option)
+{
+    size_t len = *options != NULL ? strlen(*options) : 0;
+    *options = (char*)realloc(*options, len + strlen(option) + 2);
+    if (len > 0) {
+        (*options)[len++] = ' ';
+    }
+    strcpy(*options + len, option);
+}
+
+static int CompareOptions(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+// builds clBuildProgram options string from {options = "...", defines = {NAME = value, ...}} table at index,
+// returns NULL if there are no options, otherwise the string has to be freed
+static char* GetBuildOptions(lua_State* L, int index)
+{
+    if (!lua_istable(L, index)) {
+        return NULL;
+    }
+
+    char* options = NULL;
+
+    lua_getfield(L, index, "options");
+    if (lua_isstring(L, -1)) {
+        AppendOption(&options, lua_tostring(L, -1));
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "defines");
+    if (lua_istable(L, -1)) {
+        // table order differs for equal tables, defines are sorted so equal defines give equal cache keys
+        char** defines = NULL;
+        uint32_t defines_count = 0;
+
+        lua_pushnil(L);
+        while (lua_next(L, -2) != 0) {
+            if (lua_type(L, -2) == LUA_TSTRING) {
+                const char* name = lua_tostring(L, -2);
+                const char* value = NULL;
+
+                if (lua_isboolean(L, -1)) { // flag define, e.g. {USE_SHADOWS = true}
+                    value = lua_toboolean(L, -1) ? "" : NULL;
+                }else if (lua_isstring(L, -1)) {
+                    value = lua_tostring(L, -1);
+                }
+
+                if (value != NULL) {
+                    size_t size = strlen(name) + strlen(value) + 5;
+                    char* define = (char*)malloc(size);
+                    snprintf(define, size, value[0] ? "-D%s=%s" : "-D%s%s", name, value);
+                    defines = (char**)realloc(defines, sizeof(char*) * (defines_count + 1));
+                    defines[defines_count++] = define;
+                }
+            }
+            lua_pop(L, 1);
+        }
+
+        if (defines_count > 0) {
+            qsort(defines, defines_count, sizeof(char*), CompareOptions);
+        }
+        for (uint32_t i = 0; i < defines_count; ++i) {
+            AppendOption(&options, defines[i]);
+            free(defines[i]);
+        }
+        free(defines);
+    }
+    lua_pop(L, 1);
+
+    return options;
+}
+
+// pushes program userdata, takes ownership of the program
+static void PushProgram(lua_State* L, cl_program program, device_data* device, uint64_t key)
+{
+    program_data* data = (program_data*)(lua_newuserdata(L, sizeof(program_data)));
+    data->program = program;
+    data->key = key;
+    data->device = device;
+
+    // entry could have been dropped while the program was built from it asynchronously
+    program_cache_entry* entry = FindCacheEntry(device, key);
+    if (entry == NULL) {
+        AddCachedProgram(device, key, program);
+        entry = &device->programs[device->programs_count - 1];
+    }
+    entry->refs++;
+
+    luaL_newmetatable(L, "program");
+    static const luaL_Reg functions[] =
+    {
+        {"__gc", Program_destroy},
+        {"create_kernel", CreateKernel},
+        {0, 0}
+    };
+    luaL_register(L, NULL, functions);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -1, "__index");
+    lua_setmetatable(L, -2);
+}
+
+static int LoadProgram(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    device_data* device = CheckDevice(L, 1);
+    const char* source = luaL_checkstring(L, 2);
+    char* options = GetBuildOptions(L, 3);
+
+    cl_program program = BuildProgram(device, source, options);
+
+    if (program == NULL) {
+        free(options);
+        return DM_LUA_ERROR("Can't load program.");
+    }
+
+    PushProgram(L, program, device, GetSourceKey(source, options));
+    free(options);
+
+    return 1;
+}
+
+// runs on a worker thread, so the build never blocks the frame even if the driver builds synchronously
+static void BuildProgramThread(cl_program program, cl_device_id device, char* options, cl_event event)
+{
+    cl_int status = clBuildProgram(program, 1, &device, options, NULL, NULL);
+
+    if (status != CL_SUCCESS) {
+        dmLogInfo("clBuildProgram failed: %d", status);
+    }
+
+    // negative status makes event:wait() fail, callback gets success = false from CompleteBuild
+    clSetUserEventStatus(event, status == CL_SUCCESS ? CL_COMPLETE : CL_BUILD_PROGRAM_FAILURE);
+
+    clReleaseEvent(event);
+    clReleaseProgram(program);
+    free(options);
+}
+
+static int LoadProgramAsync(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    device_data* device = CheckDevice(L, 1);
+    const char* source = luaL_checkstring(L, 2);
+    int callback = lua_gettop(L);
+    luaL_checktype(L, callback, LUA_TFUNCTION);
+    char* options = GetBuildOptions(L, 3);
+
+    build_data* build = (build_data*)malloc(sizeof(build_data));
+    build->device = device;
+    build->source_key = GetSourceKey(source, options);
+    build->disk_key = 0;
+    build->compiled = false;
+    build->program = FindCachedProgram(device, build->source_key);
+
+    // same program is being compiled already, the load completes with the event of that build
+    for (uint32_t i = 0; i < pending.Size() && build->program == NULL; ++i) {
+        build_data* other = pending[i].build;
+        if (other != NULL && other->compiled && other->device == device && other->source_key == build->source_key) {
+            build->program = other->program;
+            clRetainProgram(build->program);
+            clRetainEvent(pending[i].event);
+            PushEvent(L, pending[i].event);
+            AddPendingCallback(L, callback, pending[i].event, NULL)->build = build;
+            free(options);
+            return 1;
+        }
+    }
+
+    cl_event event = clCreateUserEvent(device->context, NULL);
+
+    if (build->program != NULL) {
+        clRetainProgram(build->program);
+    }else if (cache_path != NULL) { // loading cached binary is fast enough to do it right away
+        build->disk_key = GetProgramKey(device, source, options);
+        build->program = LoadProgramBinary(device, build->disk_key, options);
+        if (build->program != NULL) {
+            AddCachedProgram(device, build->source_key, build->program);
+        }
+    }
+
+    if (build->program != NULL) {
+        clSetUserEventStatus(event, CL_COMPLETE);
+    }else {
+        build->compiled = true;
+        build->program = clCreateProgramWithSource(device->context, 1, (const char **)&source, NULL, NULL);
+
+        // thread owns options and its own references to the program and the event
+        clRetainProgram(build->program);
+        clRetainEvent(event);
+        std::thread(BuildProgramThread, build->program, device->id, options, event).detach();
+        options = NULL;
+    }
+
+    free(options);
+
+    PushEvent(L, event);
+    AddPendingCallback(L, callback, event, NULL)->build = build;
+
+    return 1;
+}
+
+static void PushPlatformInfo(lua_State* L, cl_platform_id platform, cl_platform_info param, const char* key)
+{
+    size_t size;
+    clGetPlatformInfo(platform, param, 0, NULL, &size);
+    char* info = (char *)malloc(size);
+    clGetPlatformInfo(platform, param, size, info, NULL);
+
+    lua_pushstring(L, key);
+    lua_pushstring(L, info);
+    lua_settable(L, -3);
+
+    free(info);
+}
+
+static int GetDevices(lua_State* L)
+{
+    bool gpu = false;
+
+    if (lua_gettop(L) == 1) {
+        gpu = lua_toboolean(L, 1); 
+        lua_pop(L, 1);
+    }
+    
+    cl_device_type type = gpu ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_ALL;
+
+    lua_newtable(L);
+
+    cl_uint uint_info;
+    int index = 0;
+
+    for (cl_uint p = 0; p < num_platforms; ++p) {
+        cl_uint num_devices = 0;
+        cl_int status = clGetDeviceIDs(platforms[p], type, 0, NULL, &num_devices);
+
+        if (status != CL_SUCCESS) { // no devices of this type on the platform
+            continue;
+        }
+
+        cl_device_id* devices = (cl_device_id *)malloc(sizeof(cl_device_id) * num_devices);
+        clGetDeviceIDs(platforms[p], type, num_devices, devices, NULL);
+
+        for(int j = 0; j < num_devices; ++j) {
+
+            lua_newtable(L);
+
+            static const luaL_Reg f[] =
+            {
+                {"load_program", LoadProgram},
+                {"load_program_async", LoadProgramAsync},
+                {"create_buffer", CreateBuffer},
+                {"create_ring_buffer", CreateRingBuffer},
+                {0, 0}
+            };
+            luaL_register(L, NULL, f);
+            
+            char* str_info = GetDeviceInfoString(devices[j], CL_DEVICE_NAME);
+            //dmLogInfo("device %d: %s", j, str_info);
+
+            lua_pushstring(L, "name");
+            lua_pushstring(L, str_info);
+            lua_settable(L, -3);
+            
+            free(str_info);
+
+            lua_pushstring(L, "platform");
+            lua_newtable(L);
+            PushPlatformInfo(L, platforms[p], CL_PLATFORM_NAME, "name");
+            PushPlatformInfo(L, platforms[p], CL_PLATFORM_VENDOR, "vendor");
+            PushPlatformInfo(L, platforms[p], CL_PLATFORM_VERSION, "version");
+            lua_settable(L, -3);
+
+            clGetDeviceInfo(devices[j], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(uint_info), &uint_info, NULL);
+            //dmLogInfo("compute units: %d", uint_info);
+
+            lua_pushstring(L, "units");
+            lua_pushnumber(L, uint_info);
+            lua_settable(L, -3);
+
+            cl_device_type device_type;
+            clGetDeviceInfo(devices[j], CL_DEVICE_TYPE, sizeof(device_type), &device_type, NULL);
+
+            lua_pushstring(L, "type");
+            if (device_type & CL_DEVICE_TYPE_GPU) {
+                lua_pushstring(L, "gpu");
+            }else if (device_type & CL_DEVICE_TYPE_CPU) {
+                lua_pushstring(L, "cpu");
+            }else {
+                lua_pushstring(L, "accelerator");
+            }
+            lua_settable(L, -3);
+
+            clGetDeviceInfo(devices[j], CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(uint_info), &uint_info, NULL);
+            //dmLogInfo("max freq: %d",uint_info);
+
+            lua_pushstring(L, "freq");
+            lua_pushnumber(L, uint_info);
+            lua_settable(L, -3);
+
+            clGetDeviceInfo(devices[j], CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(uint_info), &uint_info, NULL);
+
+            lua_pushstring(L, "max_work_groups");
+            lua_pushnumber(L, uint_info);
+            lua_settable(L, -3);
+
+
+            cl_uint num;
+            clGetDeviceInfo(devices[j], CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(num), &num, NULL);
+
+            size_t dims[num];
+            clGetDeviceInfo(devices[j], CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(dims), &dims, NULL);
+
+            lua_pushstring(L, "max_work_items");
+            lua_newtable(L);
+        
+            for (int k = 0; k < num; k++)
+            {
+                lua_pushnumber(L, dims[k]);
+                lua_rawseti(L, -2, k + 1);
+            }
+
+            lua_settable(L, -3);
+
+            lua_pushstring(L, "id");
+            device_data** data = (device_data**)(lua_newuserdata(L, sizeof(device_data*)));
+            *data = GetDeviceData(platforms[p], devices[j], device_type);
+
+            luaL_newmetatable(L, "device");
+            static const luaL_Reg functions[] =
+            {
+                {0, 0}
+            };
+            luaL_register(L, NULL, functions);
+            lua_pushvalue(L, -1);
+            lua_setfield(L, -1, "__index");
+            lua_setmetatable(L, -2);
+            
+            
+            //lua_pushnumber(L,  j);
+            lua_settable(L, -3);
+
+            lua_rawseti(L, 1, ++index);
+        }
+
+        free(devices);
+    }
+
+    return 1;
+}
+
+static int SetProfiling(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    profiling = lua_toboolean(L, 1);
+
+    return 0;
+}
+
+// applies to devices used for the first time after the call, like set_profiling
+static int SetOutOfOrder(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    out_of_order = lua_toboolean(L, 1);
+
+    return 0;
+}
+
+static int SetCachePath(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    free(cache_path);
+    cache_path = lua_isnoneornil(L, 1) ? NULL : strdup(luaL_checkstring(L, 1));
+
+    return 0;
+}
+
+static int MultiKernel_destroy(lua_State* L)
+{
+    multi_kernel_data* mk = (multi_kernel_data*)luaL_checkudata(L, 1, "multikernel");
+    for (uint32_t i = 0; i < mk->count; ++i) {
+        dmScript::Unref(L, LUA_REGISTRYINDEX, mk->refs[i]);
+    }
+    free(mk->kernels);
+    free(mk->refs);
+    free(mk->rates);
+    free(mk->split);
+    return 0;
+}
+
+// calls method of every kernel with the same arguments, e.g. input buffers are uploaded to every device
+static void ForwardToKernels(lua_State* L, const char* method)
+{
+    multi_kernel_data* mk = (multi_kernel_data*)luaL_checkudata(L, 1, "multikernel");
+    int top = lua_gettop(L);
+
+    for (uint32_t i = 0; i < mk->count; ++i) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, mk->refs[i]);
+        lua_getfield(L, -1, method);
+        lua_insert(L, -2);
+        for (int j = 2; j <= top; ++j) {
+            lua_pushvalue(L, j);
+        }
+        lua_call(L, top, 0);
+    }
+}
+
+static int MultiKernelSetArgBuffer(lua_State* L)
+{
+    ForwardToKernels(L, "set_arg_buffer");
+    return 0;
+}
+
+static int MultiKernelSetArgInt(lua_State* L)
+{
+    ForwardToKernels(L, "set_arg_int");
+    return 0;
+}
+
+static int MultiKernelSetArgFloat(lua_State* L)
+{
+    ForwardToKernels(L, "set_arg_float");
+    return 0;
+}
+
+static int MultiKernelSetArgVec3(lua_State* L)
+{
+    ForwardToKernels(L, "set_arg_vec3");
+    return 0;
+}
+
+static int MultiKernelSetArgNull(lua_State* L)
+{
+    ForwardToKernels(L, "set_arg_null");
+    return 0;
+}
+
+// splits total items of the last dimension proportionally to device rates, in multiples of granularity
+static void SplitRange(multi_kernel_data* mk, size_t total, size_t granularity)
+{
+    double sum = 0;
+    for (uint32_t i = 0; i < mk->count; ++i) {
+        sum += mk->rates[i];
+    }
+
+    size_t granules = (total + granularity - 1) / granularity;
+    double acc = 0;
+    mk->split[0] = 0;
+    for (uint32_t i = 0; i < mk->count; ++i) {
+        acc += mk->rates[i];
+        size_t end = (size_t)(granules * acc / sum + 0.5) * granularity;
+        mk->split[i + 1] = end < total ? end : total;
+    }
+    mk->split[mk->count] = total;
+}
+
+static int MultiKernelRun(lua_State* L)
+{
+    using namespace std::chrono;
+
+    DM_LUA_STACK_CHECK(L, 1);
+
+    multi_kernel_data* mk = (multi_kernel_data*)luaL_checkudata(L, 1, "multikernel");
+
+    dispatch_data dd;
+    CheckDispatch(L, 2, &dd);
+
+    int last = dd.dim - 1;
+    size_t granularity = dd.has_local ? dd.local[last] : 1;
+    if (!dd.pad && dd.global[last] % granularity != 0) {
+        return DM_LUA_ERROR("Global size must be a multiple of local size, use pad option.");
+    }
+
+    SplitRange(mk, dd.global[last], granularity);
+    mk->base = dd.has_offset ? dd.offset[last] : 0;
+
+    cl_event* events = (cl_event*)calloc(mk->count, sizeof(cl_event)); // NULL for devices without a part
+    double* rates = (double*)malloc(sizeof(double) * mk->count);
+    bool all_measured = true;
+    bool failed = false;
+    steady_clock::time_point t1 = steady_clock::now();
+
+    for (uint32_t i = 0; i < mk->count; ++i) {
+        size_t size = mk->split[i + 1] - mk->split[i];
+        if (size == 0) {
+            all_measured = false;
+            continue;
+        }
+
+        dispatch_data part = dd;
+        part.global[last] = size;
+        part.has_offset = true;
+        for (int j = 0; j < last; ++j) {
+            part.offset[j] = dd.has_offset ? dd.offset[j] : 0;
+        }
+        part.offset[last] = mk->base + mk->split[i];
+
+        OrderQueue(mk->kernels[i]->device);
+
+        if (EnqueueKernel(mk->kernels[i], &part, 0, NULL, &events[i]) != CL_SUCCESS) {
+            events[i] = NULL;
+            failed = true;
+            break;
+        }
+        clFlush(mk->kernels[i]->device->queue);
+    }
+
+    // poll, so finish time of every device is known and next split follows their throughput
+    uint32_t remaining = mk->count;
+    while (remaining > 0) {
+        remaining = 0;
+        for (uint32_t i = 0; i < mk->count; ++i) {
+            if (events[i] == NULL) {
+                continue;
+            }
+
+            cl_int status = CL_QUEUED;
+            clGetEventInfo(events[i], CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+            if (status != CL_COMPLETE && status >= 0) {
+                ++remaining;
+                continue;
+            }
+
+            all_measured = all_measured && status == CL_COMPLETE;
+            double time = duration_cast< duration<double> >(steady_clock::now() - t1).count();
+            rates[i] = (mk->split[i + 1] - mk->split[i]) / (time > 1e-6 ? time : 1e-6);
+
+            StoreProfile(events[i], &mk->kernels[i]->profile[PROFILE_RUN]);
+            events[i] = NULL;
+        }
+
+        if (remaining > 0) {
+            std::this_thread::sleep_for(microseconds(100));
+        }
+    }
+
+    free(events);
+
+    // devices which did enqueue are done, so their parts don't write into buffers after the error
+    if (failed) {
+        free(rates);
+        return DM_LUA_ERROR("Kernel execution error.");
+    }
+
+    // estimated and measured rates are in different units, so they are replaced only once every device ran
+    if (all_measured) {
+        for (uint32_t i = 0; i < mk->count; ++i) {
+            mk->rates[i] = mk->measured ? mk->rates[i] * 0.5 + rates[i] * 0.5 : rates[i];
+        }
+        mk->measured = true;
+    }
+
+    free(rates);
+
+    duration<double> time_span = duration_cast< duration<double> >(steady_clock::now() - t1);
+    lua_pushnumber(L, time_span.count());
+
+    return 1;
+}
+
+// gathers count items of argument at index from all devices, each device wrote the part of its range,
+// assuming the buffer has the same number of items per item of the last dimension
+static int MultiKernelRead(lua_State* L)
+{
+    int ret = lua_gettop(L) == 3 ? 1 : 0;
+    DM_LUA_STACK_CHECK(L, ret);
+
+    multi_kernel_data* mk = (multi_kernel_data*)luaL_checkudata(L, 1, "multikernel");
+    int idx = luaL_checkint(L, 2) - 1;
+    size_t count = luaL_checkint(L, 3);
+
+    size_t total = mk->split[mk->count];
+    if (total == 0) {
+        return DM_LUA_ERROR("Multi kernel wasn't run.");
+    }
+    if (count % total != 0) {
+        return DM_LUA_ERROR("Count must be a multiple of the last dimension size.");
+    }
+
+    void* values = NULL;
+    uint32_t stride = 0;
+
+    if (ret == 0) { //return data in dmBuffer
+        dmBuffer::HBuffer buffer = dmScript::CheckBufferUnpack(L, 4);
+        dmhash_t streamName = dmScript::CheckHashOrString(L, 5);
+
+        uint32_t stream_count = 0;
+        if (dmBuffer::GetStream(buffer, streamName, &values, &stream_count, NULL, &stride) != dmBuffer::RESULT_OK) {
+            return DM_LUA_ERROR("can't get stream in output buffer");
+        }
+
+        if (count > stream_count) {
+            return DM_LUA_ERROR("count is out of output stream");
+        }
+    }
+
+    BUFFER_TYPE type = float1;
+    for (uint32_t i = 0; i < mk->count; ++i) {
+        if (idx < 0 || (cl_uint)idx >= mk->kernels[i]->args_count || mk->kernels[i]->buffers[idx].mem == NULL) {
+            return DM_LUA_ERROR("Argument isn't a buffer.");
+        }
+        type = mk->kernels[i]->buffers[idx].type;
+    }
+
+    size_t element_size = GetElementSize(type);
+    size_t per_item = count / total;
+    char* output = (char*)malloc(element_size * count);
+
+    cl_int status = CL_SUCCESS;
+
+    // parts are at the offset of the run in device buffers, output starts with the first part
+    for (uint32_t i = 0; i < mk->count && status == CL_SUCCESS; ++i) {
+        size_t offset = element_size * per_item * mk->split[i];
+        size_t size = element_size * per_item * (mk->split[i + 1] - mk->split[i]);
+        if (size > 0) {
+            OrderQueue(mk->kernels[i]->device);
+            status = clEnqueueReadBuffer(mk->kernels[i]->device->queue, mk->kernels[i]->buffers[idx].mem, CL_FALSE,
+                element_size * per_item * mk->base + offset, size, output + offset, 0, NULL, NULL);
+            clFlush(mk->kernels[i]->device->queue);
+        }
+    }
+
+    for (uint32_t i = 0; i < mk->count; ++i) {
+        clFinish(mk->kernels[i]->device->queue);
+    }
+
+    if (status != CL_SUCCESS) {
+        free(output);
+        return DM_LUA_ERROR("Read error.");
+    }
+
+    UnpackMem(L, type, output, count, values, stride);
+    free(output);
+
+    return ret;
+}
+
+static int CreateMultiKernel(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    uint32_t count = lua_objlen(L, 1);
+    if (count == 0) {
+        return DM_LUA_ERROR("At least one kernel expected.");
+    }
+
+    multi_kernel_data* mk = (multi_kernel_data*)lua_newuserdata(L, sizeof(multi_kernel_data));
+    mk->count = 0;
+    mk->kernels = (kernel_data**)malloc(sizeof(kernel_data*) * count);
+    mk->refs = (int*)malloc(sizeof(int) * count);
+    mk->rates = (double*)malloc(sizeof(double) * count);
+    mk->measured = false;
+    mk->split = (size_t*)calloc(count + 1, sizeof(size_t));
+    mk->base = 0;
+
+    luaL_newmetatable(L, "multikernel");
+    static const luaL_Reg functions[] =
+    {
+        {"__gc", MultiKernel_destroy},
+        {"set_arg_buffer", MultiKernelSetArgBuffer},
+        {"set_arg_int", MultiKernelSetArgInt},
+        {"set_arg_float", MultiKernelSetArgFloat},
+        {"set_arg_vec3", MultiKernelSetArgVec3},
+        {"set_arg_null", MultiKernelSetArgNull},
+        {"run", MultiKernelRun},
+        {"read", MultiKernelRead},
+        {0, 0}
+    };
+    luaL_register(L, NULL, functions);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -1, "__index");
+    lua_setmetatable(L, -2);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        lua_rawgeti(L, 1, i + 1);
+        kernel_data* kd = (kernel_data*)luaL_checkudata(L, -1, "kernel");
+        mk->kernels[i] = kd;
+        mk->refs[i] = dmScript::Ref(L, LUA_REGISTRYINDEX);
+        mk->count = i + 1;
+
+        // until measured, compute units * clock is the best guess of device throughput
+        cl_uint units = 1;
+        cl_uint freq = 1;
+        clGetDeviceInfo(kd->device->id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+        clGetDeviceInfo(kd->device->id, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(freq), &freq, NULL);
+        mk->rates[i] = (double)units * freq;
+    }
+
+    return 1;
+}
+
+static int CommandList_destroy(lua_State* L)
+{
+    command_list_data* list = (command_list_data*)luaL_checkudata(L, 1, "commandlist");
+    for (uint32_t i = 0; i < list->count; ++i) {
+        free(list->commands[i].output);
+    }
+    for (uint32_t i = 0; i < list->refs_count; ++i) {
+        dmScript::Unref(L, LUA_REGISTRYINDEX, list->refs[i]);
+    }
+    free(list->commands);
+    free(list->refs);
+    return 0;
+}
+
+// keeps value at index alive as long as the list
+static void RefCommandObject(lua_State* L, command_list_data* list, int index)
+{
+    lua_pushvalue(L, index);
+    list->refs = (int*)realloc(list->refs, sizeof(int) * (list->refs_count + 1));
+    list->refs[list->refs_count++] = dmScript::Ref(L, LUA_REGISTRYINDEX);
+}
+
+// appends command, returns its slot (1-based) used to patch scalar values
+static command_data* AddCommand(command_list_data* list, COMMAND_TYPE type)
+{
+    list->commands = (command_data*)realloc(list->commands, sizeof(command_data) * (list->count + 1));
+    command_data* cmd = &list->commands[list->count++];
+    memset(cmd, 0, sizeof(command_data));
+    cmd->type = type;
+    return cmd;
+}
+
+static void LoadCommandValue(lua_State* L, command_data* cmd, int index)
+{
+    if (cmd->type == COMMAND_ARG_INT) {
+        cmd->value.i = luaL_checkint(L, index);
+    }else if (cmd->type == COMMAND_ARG_FLOAT) {
+        cmd->value.f = luaL_checknumber(L, index);
+    }else {
+        luaL_checktype(L, index, LUA_TTABLE);
+        for (int i = 0; i < 3; ++i) {
+            lua_rawgeti(L, index, i + 1);
+            cmd->value.v.s[i] = luaL_checknumber(L, -1);
+            lua_pop(L, 1);
+        }
+        cmd->value.v.s[3] = 0;
+    }
+}
+
+static int RecordScalarArg(lua_State* L, COMMAND_TYPE type)
+{
+    DM_LUA_STACK_CHECK(L, 1);
+
+    command_list_data* list = (command_list_data*)luaL_checkudata(L, 1, "commandlist");
+    kernel_data* kd = (kernel_data*)luaL_checkudata(L, 2, "kernel");
+    int idx = luaL_checkint(L, 3) - 1;
+
+    command_data* cmd = AddCommand(list, type);
+    cmd->kernel = kd;
+    cmd->index = idx;
+    LoadCommandValue(L, cmd, 4);
+    RefCommandObject(L, list, 2);
+
+    lua_pushinteger(L, list->count);
+    return 1;
+}
+
+static int CommandListSetArgInt(lua_State* L)
+{
+    return RecordScalarArg(L, COMMAND_ARG_INT);
+}
+
+static int CommandListSetArgFloat(lua_State* L)
+{
+    return RecordScalarArg(L, COMMAND_ARG_FLOAT);
+}
+
+static int CommandListSetArgVec3(lua_State* L)
+{
+    return RecordScalarArg(L, COMMAND_ARG_VEC3);
+}
+
+static int CommandListSetArgMem(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    command_list_data* list = (command_list_data*)luaL_checkudata(L, 1, "commandlist");
+    kernel_data* kd = (kernel_data*)luaL_checkudata(L, 2, "kernel");
+    int idx = luaL_checkint(L, 3) - 1;
+    mem_data* md = (mem_data*)luaL_checkudata(L, 4, "clbuffer");
+
+    if (md->device != kd->device) {
+        return DM_LUA_ERROR("buffer belongs to another device");
+    }
+
+    command_data* cmd = AddCommand(list, COMMAND_ARG_MEM);
+    cmd->kernel = kd;
+    cmd->index = idx;
+    cmd->src = md;
+    RefCommandObject(L, list, 2);
+    RefCommandObject(L, list, 4);
+
+    return 0;
+}
+
+static int CommandListRun(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    command_list_data* list = (command_list_data*)luaL_checkudata(L, 1, "commandlist");
+    kernel_data* kd = (kernel_data*)luaL_checkudata(L, 2, "kernel");
+
+    dispatch_data dd;
+    CheckDispatch(L, 3, &dd);
+
+    command_data* cmd = AddCommand(list, COMMAND_RUN);
+    cmd->kernel = kd;
+    cmd->dispatch = dd;
+    RefCommandObject(L, list, 2);
+
+    return 0;
+}
+
+// copies count items (all items of the smaller buffer by default) between buffers of the same device
+static int CommandListCopy(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
+
+    command_list_data* list = (command_list_data*)luaL_checkudata(L, 1, "commandlist");
+    mem_data* src = (mem_data*)luaL_checkudata(L, 2, "clbuffer");
+    mem_data* dst = (mem_data*)luaL_checkudata(L, 3, "clbuffer");
 
-    kernel_data* kd = (kernel_data*)luaL_checkudata(L, 1, "kernel");
-    cl_uint dim = luaL_checknumber(L, 2);
+    if (src->device != dst->device) {
+        return DM_LUA_ERROR("buffers belong to different devices");
+    }
+    if (src->type != dst->type) {
+        return DM_LUA_ERROR("buffer types don't match");
+    }
 
-    size_t global_work_size[dim];
-    size_t local_work_size[dim];
+    size_t count = src->count < dst->count ? src->count : dst->count;
+    count = luaL_optint(L, 4, count);
 
-    bool has_local_size = lua_gettop(L) == 4;
+    command_data* cmd = AddCommand(list, COMMAND_COPY);
+    cmd->src = src;
+    cmd->dst = dst;
+    cmd->count = count;
+    RefCommandObject(L, list, 2);
+    RefCommandObject(L, list, 3);
 
-    LoadWorkSize(L, global_work_size, 3, dim);
+    return 0;
+}
 
-    size_t* local = NULL;
+// list:read(clbuffer, count, buffer, stream) or list:read(kernel, index, count, buffer, stream)
+static int CommandListRead(lua_State* L)
+{
+    DM_LUA_STACK_CHECK(L, 0);
 
-    if (has_local_size) {
-        LoadWorkSize(L, local_work_size, 4, dim);
-        local = local_work_size;
-    }
+    command_list_data* list = (command_list_data*)luaL_checkudata(L, 1, "commandlist");
 
-    steady_clock::time_point t1 = steady_clock::now();
+    kernel_data* kd = NULL;
+    mem_data* md = NULL;
+    int idx = 0;
+    int arg = 3;
 
-    cl_int status = clEnqueueNDRangeKernel(*kd->queue, kd->kernel, dim, NULL, global_work_size, local, 0, NULL, NULL);
-    //dmLogInfo("execution status: %d", status);
+    if (lua_isnumber(L, 4)) { // kernel, index, count, argument is checked on submit as it can be bound by the list itself
+        kd = (kernel_data*)luaL_checkudata(L, 2, "kernel");
+        idx = luaL_checkint(L, 3) - 1;
+        if (idx < 0) {
+            return DM_LUA_ERROR("Argument isn't a buffer.");
+        }
+        arg = 4;
+    }else {
+        md = (mem_data*)luaL_checkudata(L, 2, "clbuffer");
+    }
 
-    if (status != CL_SUCCESS) {
-        return DM_LUA_ERROR("Kernel execution error.");
+    size_t count = luaL_checkint(L, arg);
+    dmBuffer::HBuffer buffer = dmScript::CheckBufferUnpack(L, arg + 1);
+    dmhash_t streamName = dmScript::CheckHashOrString(L, arg + 2);
+
+    void* values = NULL;
+    uint32_t stream_count = 0;
+    if (dmBuffer::GetStream(buffer, streamName, &values, &stream_count, NULL, NULL) != dmBuffer::RESULT_OK) {
+        return DM_LUA_ERROR("can't get stream in output buffer");
     }
 
-    clFinish(*kd->queue);
+    if (count > stream_count) {
+        return DM_LUA_ERROR("count is out of output stream");
+    }
 
-    steady_clock::time_point t2 = steady_clock::now();
-    duration<double> time_span = duration_cast< duration<double> >(t2 - t1);
-    
-    lua_pushnumber(L, time_span.count());
+    // type of kernel argument is known on submit only, so output fits the largest element
+    size_t element_size = md != NULL ? GetElementSize(md->type) : sizeof(cl_float3);
+
+    command_data* cmd = AddCommand(list, COMMAND_READ);
+    cmd->kernel = kd;
+    cmd->index = idx;
+    cmd->src = md;
+    cmd->count = count;
+    cmd->buffer = buffer;
+    cmd->stream = streamName;
+    cmd->size = element_size * count;
+    cmd->output = malloc(cmd->size);
+    RefCommandObject(L, list, 2);
+    RefCommandObject(L, list, arg + 1);
 
-    return 1;
+    return 0;
 }
 
-template <typename T>
-void Read(lua_State* L, cl_command_queue queue, cl_mem buf, size_t count, T* values, uint32_t stride) 
+// changes scalar value of a recorded set_arg command
+static int CommandListSet(lua_State* L)
 {
-    T output[count];
+    DM_LUA_STACK_CHECK(L, 0);
 
-    clEnqueueReadBuffer(queue,
-        buf,
-        CL_TRUE,
-        0,
-        sizeof(T) * count,
-        output,
-        0,
-        NULL,
-        NULL);
+    command_list_data* list = (command_list_data*)luaL_checkudata(L, 1, "commandlist");
+    int slot = luaL_checkint(L, 2) - 1;
 
-    if (values != NULL) {
-        for (int i = 0; i < count; i++) {
-            values[0] = output[i];
-            values += stride;
-        }
-        return;
+    if (slot < 0 || slot >= (int)list->count || list->commands[slot].type > COMMAND_ARG_VEC3) {
+        return DM_LUA_ERROR("Invalid slot.");
     }
 
-    lua_newtable(L);
+    LoadCommandValue(L, &list->commands[slot], 3);
 
-    for (int i = 0; i < count; i++) {
-        lua_pushnumber(L, output[i]);
-        lua_rawseti(L, -2, i + 1);
-    }
+    return 0;
 }
 
-template <typename T, typename CLT>
-void ReadVectors(lua_State* L, cl_command_queue queue, cl_mem buf, size_t count, T *values, uint32_t stride) 
-{
-    CLT output[count];
-
-    clEnqueueReadBuffer(queue,
-        buf,
-        CL_TRUE,
-        0,
-        sizeof(CLT) * count,
-        output,
-        0,
-        NULL,
-        NULL);
-
-        if (values != NULL) {
-            for (uint i = 0; i < count; i++) {
-                values[0] = output[i].x;
-                values[1] = output[i].y;
-                values[2] = output[i].z;
-
-                values += stride;
-            }
+static void AddCommandDevice(device_data** devices, uint32_t* count, device_data* device)
+{
+    for (uint32_t i = 0; i < *count; ++i) {
+        if (devices[i] == device) {
             return;
         }
+    }
+    devices[(*count)++] = device;
+}
 
-        lua_newtable(L);
+// replays all commands, blocks until they are done and read data is in dmBuffers
+static int CommandListSubmit(lua_State* L)
+{
+    using namespace std::chrono;
 
-        for (int i = 0; i < count; i++) {
-            lua_newtable(L);
+    DM_LUA_STACK_CHECK(L, 1);
 
-            lua_pushnumber(L, output[i].x);
-            lua_rawseti(L, -2, 1);
-            lua_pushnumber(L, output[i].y);
-            lua_rawseti(L, -2, 2);
-            lua_pushnumber(L, output[i].z);
-            lua_rawseti(L, -2, 3);
+    command_list_data* list = (command_list_data*)luaL_checkudata(L, 1, "commandlist");
 
-            lua_rawseti(L, -2, i + 1);
+    steady_clock::time_point t1 = steady_clock::now();
+
+    device_data** devices = (device_data**)malloc(sizeof(device_data*) * (list->count + 1));
+    uint32_t devices_count = 0;
+    cl_int status = CL_SUCCESS;
+
+    for (uint32_t i = 0; i < list->count && status == CL_SUCCESS; ++i) {
+        command_data* cmd = &list->commands[i];
+        kernel_data* kd = cmd->kernel;
+
+        switch (cmd->type) {
+            case COMMAND_ARG_INT:
+            case COMMAND_ARG_FLOAT:
+            case COMMAND_ARG_VEC3:
+                AllocBufferData(L, kd, cmd->index);
+                kd->buffers[cmd->index].mem = NULL;
+                status = clSetKernelArg(kd->kernel, cmd->index,
+                    cmd->type == COMMAND_ARG_INT ? sizeof(cl_int) : (cmd->type == COMMAND_ARG_FLOAT ? sizeof(cl_float) : sizeof(cl_float3)),
+                    &cmd->value);
+                break;
+            case COMMAND_ARG_MEM:
+                AllocBufferData(L, kd, cmd->index);
+                clRetainMemObject(cmd->src->mem); // released with the kernel argument
+                kd->buffers[cmd->index].mem = cmd->src->mem;
+                kd->buffers[cmd->index].type = cmd->src->type;
+                status = clSetKernelArg(kd->kernel, cmd->index, sizeof(cl_mem), &cmd->src->mem);
+                break;
+            case COMMAND_RUN:
+                OrderQueue(kd->device);
+                status = EnqueueKernel(kd, &cmd->dispatch, 0, NULL, NULL);
+                AddCommandDevice(devices, &devices_count, kd->device);
+                break;
+            case COMMAND_COPY:
+                OrderQueue(cmd->src->device);
+                status = clEnqueueCopyBuffer(cmd->src->device->queue, cmd->src->mem, cmd->dst->mem, 0, 0,
+                    GetElementSize(cmd->src->type) * cmd->count, 0, NULL, NULL);
+                AddCommandDevice(devices, &devices_count, cmd->src->device);
+                break;
+            case COMMAND_READ:
+                if (kd != NULL) {
+                    if (cmd->index >= kd->args_count || kd->buffers[cmd->index].mem == NULL || GetElementSize(kd->buffers[cmd->index].type) * cmd->count > cmd->size) {
+                        status = CL_INVALID_MEM_OBJECT;
+                        break;
+                    }
+                    OrderQueue(kd->device);
+                    status = clEnqueueReadBuffer(kd->device->queue, kd->buffers[cmd->index].mem, CL_FALSE, 0,
+                        GetElementSize(kd->buffers[cmd->index].type) * cmd->count, cmd->output, 0, NULL, NULL);
+                    AddCommandDevice(devices, &devices_count, kd->device);
+                }else {
+                    OrderQueue(cmd->src->device);
+                    status = clEnqueueReadBuffer(cmd->src->device->queue, cmd->src->mem, CL_FALSE, 0,
+                        GetElementSize(cmd->src->type) * cmd->count, cmd->output, 0, NULL, NULL);
+                    AddCommandDevice(devices, &devices_count, cmd->src->device);
+                }
+                break;
         }
     }
 
-static int ReadKernelBuffer(lua_State* L) 
-{
-    int ret = lua_gettop(L) == 3 ? 1 : 0;
-    DM_LUA_STACK_CHECK(L, ret);
+    for (uint32_t i = 0; i < devices_count; ++i) {
+        clFinish(devices[i]->queue);
+    }
+    free(devices);
 
-    kernel_data* kd = (kernel_data*)luaL_checkudata(L, 1, "kernel");
-    int idx = luaL_checkint(L, 2) - 1;
-    size_t count = luaL_checkint(L, 3);
+    if (status != CL_SUCCESS) {
+        return DM_LUA_ERROR("Command list execution error: %d", status);
+    }
 
-    void* values = NULL;
-    uint32_t stride = 0;
-    
-    if (ret == 0) { //return data in dmBuffer
-        dmBuffer::HBuffer output = dmScript::CheckBufferUnpack(L, 4);
-        dmhash_t streamName = dmScript::CheckHashOrString(L, 5);
-  
-        dmBuffer::Result dataResult = dmBuffer::GetStream(output, streamName, (void**)&values, NULL, NULL, &stride);
-        if (dataResult != dmBuffer::RESULT_OK) {
-            return DM_LUA_ERROR("can't get stream in output buffer");
+    for (uint32_t i = 0; i < list->count; ++i) {
+        command_data* cmd = &list->commands[i];
+        if (cmd->type != COMMAND_READ) {
+            continue;
         }
-    }
 
-    switch(kd->buffers[idx].type) {
-        case float3: 
-            ReadVectors<float, cl_float3>(L, *kd->queue, kd->buffers[idx].mem, count, (float*)values, stride);
-            break;
-        case uchar3: 
-            ReadVectors<unsigned char, cl_uchar3>(L, *kd->queue, kd->buffers[idx].mem, count, (unsigned char*)values, stride);
-            break;
-        case uint3: 
-            ReadVectors<uint32_t, cl_uint3>(L, *kd->queue, kd->buffers[idx].mem, count, (uint32_t*)values, stride);
-            break;
-        case uchar1: 
-            Read<unsigned char>(L, *kd->queue, kd->buffers[idx].mem, count, (unsigned char*)values, stride);
-            break;
-        case uint1: 
-            Read<uint32_t>(L, *kd->queue, kd->buffers[idx].mem, count, (uint32_t*)values, stride);
-            break;
-        case float1: 
-            Read<float>(L, *kd->queue, kd->buffers[idx].mem, count, (float*)values, stride);
-            break;
+        void* values = NULL;
+        uint32_t stride = 0;
+        uint32_t stream_count = 0;
+
+        // buffer is referenced, but could have been destroyed explicitly
+        if (dmBuffer::IsBufferValid(cmd->buffer) &&
+            dmBuffer::GetStream(cmd->buffer, cmd->stream, &values, &stream_count, NULL, &stride) == dmBuffer::RESULT_OK &&
+            cmd->count <= stream_count) {
+            BUFFER_TYPE type = cmd->kernel != NULL ? cmd->kernel->buffers[cmd->index].type : cmd->src->type;
+            UnpackMem(L, type, cmd->output, cmd->count, values, stride);
+        }
     }
-   
 
-    return ret;
+    duration<double> time_span = duration_cast< duration<double> >(steady_clock::now() - t1);
+    lua_pushnumber(L, time_span.count());
+
+    return 1;
 }
 
-static int CreateKernel(lua_State* L)
+static int CreateCommandList(lua_State* L)
 {
     DM_LUA_STACK_CHECK(L, 1);
 
-    const char* name = luaL_checkstring(L, -1);
-    program_data* p = (program_data*)luaL_checkudata(L, 1, "program"); 
-
-    cl_int err;
-    cl_kernel kernel = clCreateKernel(p->program, name, &err);
-
-    if (err != 0) {
-        return DM_LUA_ERROR("Can't create kernel.");
-    }
-
-    kernel_data* data = (kernel_data*)(lua_newuserdata(L, sizeof(kernel_data)));
-    data->kernel = kernel;
-    data->args_count = 0;
-    data->buffers = NULL;
-    data->queue = p->queue;
-    data->context = p->context;
+    command_list_data* list = (command_list_data*)lua_newuserdata(L, sizeof(command_list_data));
+    list->commands = NULL;
+    list->count = 0;
+    list->refs = NULL;
+    list->refs_count = 0;
 
-    luaL_newmetatable(L, "kernel");
+    luaL_newmetatable(L, "commandlist");
     static const luaL_Reg functions[] =
     {
-        {"__gc", Kernel_destroy},
-        {"set_arg_buffer", SetKernelArgBuffer},
-        {"set_arg_int", SetKernelArgInt},
-        {"set_arg_float", SetKernelArgFloat},
-        {"set_arg_vec3", SetKernelArgVec3},
-        {"set_arg_null", SetKernelArgNull},
-        {"run", RunKernel},
-        {"read", ReadKernelBuffer},
+        {"__gc", CommandList_destroy},
+        {"set_arg_int", CommandListSetArgInt},
+        {"set_arg_float", CommandListSetArgFloat},
+        {"set_arg_vec3", CommandListSetArgVec3},
+        {"set_arg_mem", CommandListSetArgMem},
+        {"run", CommandListRun},
+        {"copy", CommandListCopy},
+        {"read", CommandListRead},
+        {"set", CommandListSet},
+        {"submit", CommandListSubmit},
         {0, 0}
     };
     luaL_register(L, NULL, functions);
     lua_pushvalue(L, -1);
     lua_setfield(L, -1, "__index");
     lua_setmetatable(L, -2);
+
     return 1;
 }
 
-static int LoadProgram(lua_State* L)
+// Functions exposed to Lua
+static const luaL_reg Module_methods[] =
 {
-    DM_LUA_STACK_CHECK(L, 1);
+    {"get_devices", GetDevices},
+    {"set_cache_path", SetCachePath},
+    {"set_profiling", SetProfiling},
+    {"set_out_of_order", SetOutOfOrder},
+    {"create_multi_kernel", CreateMultiKernel},
+    {"create_command_list", CreateCommandList},
+    {0, 0}
+};
 
-    const char* source = luaL_checkstring(L, -1);
+static void LuaInit(lua_State* L)
+{
+    int top = lua_gettop(L);
 
-    device_data* device = NULL;
-    if (lua_istable(L, 1)) {
-        lua_getfield(L, 1, "id");
-        device = (device_data*)luaL_checkudata(L, -1, "device"); 
-        lua_pop(L, 1);
-    }else {
-        dmLogInfo("device id");
-        device = (device_data*)luaL_checkudata(L, 1, "device"); 
-    }
+    // Register lua names
+    luaL_register(L, MODULE_NAME, Module_methods);
 
-    if (device->context == NULL) {
-        device->context = clCreateContext(NULL, 1, &device->id, NULL, NULL, NULL);
-        device->queue = clCreateCommandQueue(device->context, device->id, 0, NULL);
-    }
+#define SETCONSTANT(name, value) \
+    lua_pushnumber(L, (lua_Number) value); \
+    lua_setfield(L, -2, #name);
 
-    cl_program program = clCreateProgramWithSource(device->context, 1, (const char **)&source, NULL, NULL);
+    SETCONSTANT(TYPE_FLOAT, float1);
+    SETCONSTANT(TYPE_UCHAR, uchar1);
+    SETCONSTANT(TYPE_UINT, uint1);
+    SETCONSTANT(TYPE_FLOAT3, float3);
+    SETCONSTANT(TYPE_UCHAR3, uchar3);
+    SETCONSTANT(TYPE_UINT3, uint3);
 
-    cl_int status = clBuildProgram(program, 1, &device->id, NULL, NULL, NULL);
+#undef SETCONSTANT
 
-    if(status != CL_SUCCESS) {
-        dmLogInfo("clBuildProgram failed: %d", status);
-        return DM_LUA_ERROR("Can't load program.");
+    lua_pop(L, 1);
+    assert(top == lua_gettop(L));
+}
+
+static dmExtension::Result InitializeExtension(dmExtension::Params* params)
+{
+    // Init Lua
+    LuaInit(params->m_L);
+    dmLogInfo("Registered %s Extension", MODULE_NAME);
 
+    cl_int status = clGetPlatformIDs(0, NULL, &num_platforms);
+
+    if (status != CL_SUCCESS || num_platforms == 0) {
+        dmLogWarning("No OpenCL platforms found: %d", status);
+        num_platforms = 0;
+        return dmExtension::RESULT_OK;
     }
 
-    program_data* data = (program_data*)(lua_newuserdata(L, sizeof(program_data)));
-    data->program = program;
-    data->queue = &device->queue;
-    data->context = &device->context;
+    platforms = (cl_platform_id*)malloc(sizeof(cl_platform_id) * num_platforms);
+    clGetPlatformIDs(num_platforms, platforms, NULL);
 
-    luaL_newmetatable(L, "program");
-    static const luaL_Reg functions[] =
-    {
-        {"__gc", Program_destroy},
-        {"create_kernel", CreateKernel},
-        {0, 0}
-    };
-    luaL_register(L, NULL, functions);
-    lua_pushvalue(L, -1);
-    lua_setfield(L, -1, "__index");
-    lua_setmetatable(L, -2);
+    return dmExtension::RESULT_OK;
+}
 
-    return 1;
+static void InvokePendingCallback(pending_data* pd, bool success)
+{
+    lua_State* L = dmScript::GetCallbackLuaContext(pd->callback);
+    DM_LUA_STACK_CHECK(L, 0);
+
+    if (dmScript::SetupCallback(pd->callback)) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, pd->ref);
+        lua_pushboolean(L, success);
+
+        if (pd->read != NULL && pd->read->buffer_ref == LUA_NOREF && success) { // read result as table
+            UnpackMem(L, pd->read->type, pd->read->output, pd->read->count, NULL, 0);
+            dmScript::PCall(L, 4, 0);
+        }else if (pd->build != NULL && success) {
+            PushProgram(L, pd->build->program, pd->build->device, pd->build->source_key);
+            pd->build->program = NULL; // owned by program userdata now
+            dmScript::PCall(L, 4, 0);
+        }else {
+            dmScript::PCall(L, 3, 0);
+        }
+
+        dmScript::TeardownCallback(pd->callback);
+    }
 }
 
-static int GetDevices(lua_State* L)
+static void CompleteRead(lua_State* L, read_data* read, bool success)
 {
-    bool gpu = false;
+    if (read->buffer_ref != LUA_NOREF) {
+        void* values = NULL;
+        uint32_t stride = 0;
 
-    if (lua_gettop(L) == 1) {
-        gpu = lua_toboolean(L, 1); 
-        lua_pop(L, 1);
+        uint32_t stream_count = 0;
+
+        // buffer is referenced, but could have been destroyed explicitly
+        if (success && dmBuffer::IsBufferValid(read->buffer) && 
+            dmBuffer::GetStream(read->buffer, read->stream, &values, &stream_count, NULL, &stride) == dmBuffer::RESULT_OK &&
+            read->count <= stream_count) {
+            UnpackMem(L, read->type, read->output, read->count, values, stride);
+        }
+
+        dmScript::Unref(L, LUA_REGISTRYINDEX, read->buffer_ref);
     }
-    
-    cl_device_type type = gpu ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_ALL;
-    
-    cl_uint num_devices;
-    cl_int status = clGetDeviceIDs(platform_id, type, 0, NULL, &num_devices);
+}
 
-    cl_device_id* devices = (cl_device_id *)malloc(sizeof(cl_device_id) * num_devices);
-    clGetDeviceIDs(platform_id, type, num_devices, devices, NULL);
+// returns true if the program was built successfully
+static bool CompleteBuild(build_data* build)
+{
+    cl_build_status status = CL_BUILD_ERROR;
+    clGetProgramBuildInfo(build->program, build->device->id, CL_PROGRAM_BUILD_STATUS, sizeof(status), &status, NULL);
 
-    lua_newtable(L);
+    if (status != CL_BUILD_SUCCESS) {
+        dmLogInfo("async program build failed: %d", status);
+        return false;
+    }
 
-    size_t  str_info_size;
-    char *  str_info;
-    cl_uint uint_info;
+    if (build->compiled) {
+        AddCachedProgram(build->device, build->source_key, build->program);
+        if (cache_path != NULL) {
+            SaveProgramBinary(build->program, build->disk_key);
+        }
+    }
 
-    for(int j = 0; j < num_devices; ++j) {
+    return true;
+}
 
-        lua_newtable(L);
+static void ReleasePending(lua_State* L, pending_data* pd)
+{
+    if (pd->read != NULL) {
+        free(pd->read->output);
+        free(pd->read);
+    }
 
-        static const luaL_Reg f[] =
-        {
-            {"load_program", LoadProgram},
-            {0, 0}
-        };
-        luaL_register(L, NULL, f);
-        
-        clGetDeviceInfo(devices[j], CL_DEVICE_NAME, 0, NULL, &str_info_size);
-        str_info = (char *)malloc(str_info_size);
-        clGetDeviceInfo(devices[j], CL_DEVICE_NAME, str_info_size, str_info, NULL);
-        //dmLogInfo("device %d: %s", j, str_info);
-
-        lua_pushstring(L, "name");
-        lua_pushstring(L, str_info);
-        lua_settable(L, -3);
-        
-        free(str_info);
+    if (pd->build != NULL) {
+        if (pd->build->program != NULL) {
+            clReleaseProgram(pd->build->program);
+        }
+        free(pd->build);
+    }
 
-        clGetDeviceInfo(devices[j], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(uint_info), &uint_info, NULL);
-        //dmLogInfo("compute units: %d", uint_info);
+    free(pd->host);
 
-        lua_pushstring(L, "units");
-        lua_pushnumber(L, uint_info);
-        lua_settable(L, -3);
+    if (pd->callback != NULL) {
+        dmScript::DestroyCallback(pd->callback);
+    }
 
-        /*
-        clGetDeviceInfo(devices[j], CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(uint_info), &uint_info, NULL);
-        //dmLogInfo("max freq: %d",uint_info);
+    dmScript::Unref(L, LUA_REGISTRYINDEX, pd->ref);
+    clReleaseEvent(pd->event);
+}
 
-        lua_pushstring(L, "freq");
-        lua_pushnumber(L, uint_info);
-        lua_settable(L, -3);*/
+static dmExtension::Result OnUpdateExtension(dmExtension::Params* params)
+{
+    for (uint32_t i = 0; i < pending.Size();) {
+        cl_int status = CL_QUEUED;
+        clGetEventInfo(pending[i].event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
 
-        clGetDeviceInfo(devices[j], CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(uint_info), &uint_info, NULL);
+        if (status != CL_COMPLETE && status >= 0) {
+            ++i;
+            continue;
+        }
 
-        lua_pushstring(L, "max_work_groups");
-        lua_pushnumber(L, uint_info);
-        lua_settable(L, -3);
+        // callback may enqueue new work, so remove the entry first
+        pending_data pd = pending[i];
+        pending.EraseSwap(i);
 
+        bool success = status == CL_COMPLETE;
 
-        cl_uint num;
-        clGetDeviceInfo(devices[j], CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(num), &num, NULL);
+        if (pd.read != NULL) {
+            CompleteRead(params->m_L, pd.read, success);
+        }
 
-        size_t dims[num];
-        clGetDeviceInfo(devices[j], CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(dims), &dims, NULL);
+        if (pd.build != NULL) {
+            success = CompleteBuild(pd.build);
+        }
 
-        lua_pushstring(L, "max_work_items");
-        lua_newtable(L);
-    
-        for (int k = 0; k < num; k++)
-        {
-            lua_pushnumber(L, dims[k]);
-            lua_rawseti(L, -2, k + 1);
+        if (pd.callback != NULL) {
+            InvokePendingCallback(&pd, success);
         }
 
-        lua_settable(L, -3);
+        ReleasePending(params->m_L, &pd);
+    }
 
-        lua_pushstring(L, "id");
-        device_data* data = (device_data*)(lua_newuserdata(L, sizeof(device_data)));
-        data->id = devices[j];
-        data->context = NULL;
-        data->queue = NULL;
+    for (uint32_t i = 0; i < jobs.Size();) {
+        slice_job_data* job = jobs[i];
+        bool success = !job->cancelled && StepJob(job);
+        size_t total = job->dispatch.global[job->dispatch.dim - 1];
 
-        luaL_newmetatable(L, "device");
-        static const luaL_Reg functions[] =
-        {
-            {"__gc", Device_destroy},
-            {0, 0}
-        };
-        luaL_register(L, NULL, functions);
-        lua_pushvalue(L, -1);
-        lua_setfield(L, -1, "__index");
-        lua_setmetatable(L, -2);
-        
-        
-        //lua_pushnumber(L,  j);
-        lua_settable(L, -3);
+        if (success && job->done < total) {
+            ++i;
+            continue;
+        }
 
-        lua_rawseti(L, 1, j + 1);
+        // callback may start new jobs, so remove the entry first
+        jobs.EraseSwap(i);
+        CompleteJob(params->m_L, job, success);
     }
 
-    free(devices);
-    return 1;
+    return dmExtension::RESULT_OK;
 }
 
-// Functions exposed to Lua
-static const luaL_reg Module_methods[] =
-{
-    {"get_devices", GetDevices},
-    {0, 0}
-};
-
-static void LuaInit(lua_State* L)
+static dmExtension::Result FinalizeExtension(dmExtension::Params* params)
 {
-    int top = lua_gettop(L);
+    //dmLogInfo("FinalizeMyExtension");
+    for (uint32_t i = 0; i < pending.Size(); ++i) {
+        clWaitForEvents(1, &pending[i].event); // device mustn't write into released memory, builds must finish
+        if (pending[i].read != NULL && pending[i].read->buffer_ref != LUA_NOREF) {
+            dmScript::Unref(params->m_L, LUA_REGISTRYINDEX, pending[i].read->buffer_ref);
+        }
+        ReleasePending(params->m_L, &pending[i]);
+    }
+    pending.SetSize(0);
 
-    // Register lua names
-    luaL_register(L, MODULE_NAME, Module_methods);
+    for (uint32_t i = 0; i < jobs.Size(); ++i) {
+        ReleaseJob(params->m_L, jobs[i]);
+    }
+    jobs.SetSize(0);
 
-    lua_pop(L, 1);
-    assert(top == lua_gettop(L));
-}
+    for (uint32_t i = 0; i < device_registry.Size(); ++i) {
+        ReleaseDeviceData(device_registry[i]);
+    }
+    device_registry.SetSize(0);
 
-static dmExtension::Result InitializeExtension(dmExtension::Params* params)
-{
-    // Init Lua
-    LuaInit(params->m_L);
-    dmLogInfo("Registered %s Extension", MODULE_NAME);
+    free(platforms);
+    platforms = NULL;
+    num_platforms = 0;
 
-    cl_uint num_platforms;
-    cl_int status = clGetPlatformIDs(1, &platform_id, &num_platforms);
-    
+    free(cache_path);
+    cache_path = NULL;
     return dmExtension::RESULT_OK;
 }
 
@@ -671,29 +4247,28 @@ static dmExtension::Result InitializeExtension(dmExtension::Params* params)
     return dmExtension::RESULT_OK;
 }
 
-#endif // platforms
-
-static dmExtension::Result AppInitializeExtension(dmExtension::AppParams* params)
+static dmExtension::Result OnUpdateExtension(dmExtension::Params* params)
 {
-    dmLogInfo("AppInitializeMyExtension");
     return dmExtension::RESULT_OK;
 }
 
-static dmExtension::Result AppFinalizeExtension(dmExtension::AppParams* params)
+static dmExtension::Result FinalizeExtension(dmExtension::Params* params)
 {
-    //dmLogInfo("AppFinalizeMyExtension");
+    //dmLogInfo("FinalizeMyExtension");
     return dmExtension::RESULT_OK;
 }
 
-static dmExtension::Result FinalizeExtension(dmExtension::Params* params)
+#endif // platforms
+
+static dmExtension::Result AppInitializeExtension(dmExtension::AppParams* params)
 {
-    //dmLogInfo("FinalizeMyExtension");
+    dmLogInfo("AppInitializeMyExtension");
     return dmExtension::RESULT_OK;
 }
 
-static dmExtension::Result OnUpdateExtension(dmExtension::Params* params)
+static dmExtension::Result AppFinalizeExtension(dmExtension::AppParams* params)
 {
-    //dmLogInfo("OnUpdateMyExtension");
+    //dmLogInfo("AppFinalizeMyExtension");
     return dmExtension::RESULT_OK;
 }
 
@@ -727,5 +4302,5 @@ static void OnEventExtension(dmExtension::Params* params, const dmExtension::Eve
 
 
 
-DM_DECLARE_EXTENSION(OpenCL, LIB_NAME, AppInitializeExtension, AppFinalizeExtension, InitializeExtension, NULL, NULL, FinalizeExtension)
+DM_DECLARE_EXTENSION(OpenCL, LIB_NAME, AppInitializeExtension, AppFinalizeExtension, InitializeExtension, OnUpdateExtension, NULL, FinalizeExtension)
 